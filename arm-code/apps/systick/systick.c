@@ -0,0 +1,39 @@
+/*
+ * The SysTick exception interrupts the main loop ten times, every handler
+ * returns to where main was. Run with the systick plugin, main returns 10.
+ */
+#include <stdint.h>
+
+#define SCB_VTOR    (*(volatile uint32_t *)0xE000ED08)
+#define SYST_CSR    (*(volatile uint32_t *)0xE000E010)
+#define SYST_RVR    (*(volatile uint32_t *)0xE000E014)
+#define SYST_CVR    (*(volatile uint32_t *)0xE000E018)
+
+#define SYST_CSR_ENABLE  (1 << 0)
+#define SYST_CSR_TICKINT (1 << 1)
+
+extern void (* const g_am_pfnVectors[])(void);
+
+volatile int ticks = 0;
+volatile int loops = 0;
+
+void SysTick_Handler(void)
+{
+    ticks += 1;
+}
+
+int main(void)
+{
+    SCB_VTOR = (uint32_t)g_am_pfnVectors;
+
+    SYST_RVR = 999;
+    SYST_CVR = 0;
+    SYST_CSR = SYST_CSR_ENABLE | SYST_CSR_TICKINT;
+
+    while (ticks < 10) {
+        loops += 1;
+    }
+
+    SYST_CSR = 0;
+    return ticks;
+}
@@ -0,0 +1,41 @@
+/**
+ *  ICEmu loadable plugin (library)
+ *
+ * An example ICEmu plugin that is dynamically loaded.
+ * This example prints every basic block that is executed.
+ *
+ * Should be compiled as a shared library, i.e. using `-shared -fPIC`
+ */
+#include <iostream>
+
+#include "icemu/emu/Emulator.h"
+#include "icemu/hooks/HookBlock.h"
+#include "icemu/hooks/HookManager.h"
+#include "icemu/hooks/RegisterHook.h"
+
+using namespace std;
+using namespace icemu;
+
+class MyHookBlockPlugin : public HookBlock {
+ public:
+  // No address range would always execute
+  MyHookBlockPlugin(Emulator &emu) : HookBlock(emu, "Hook Block Pluging Example") {
+    cout << "Constructor my DLL block hook" << endl;
+  }
+
+  // Hook run
+  void run(hook_arg_t *arg) {
+    cout << name << ": run() at address: " << arg->address
+         << " size: " << arg->size << " instructions: " << arg->icount << endl;
+  }
+};
+
+// Function that registers the hook
+static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
+  HM.add(new MyHookBlockPlugin(emu));
+}
+
+// Class that is used by ICEmu to finf the register function
+// NB.  * MUST BE NAMED "RegisterMyHook"
+//      * MUST BE global
+RegisterHook RegisterMyHook(registerMyCodeHook);
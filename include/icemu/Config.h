@@ -19,12 +19,43 @@ class Config {
     std::string name;
     address_t origin;
     address_t length;
+    bool is_volatile;  // Loses its content on a power failure (e.g., SRAM)
+    bool huge_pages;   // Back the region with transparent huge pages
+    std::string file;  // Host file backing the region (persistent), if any
+    uint8_t permissions;  // PERM_* flags
+    bool sparse;       // Only map the parts the guest touches
+    bool elf_permissions;  // Pages of the elf segments get their permissions
+  };
+
+  // Memory region permissions
+  enum {
+    PERM_READ = 1,
+    PERM_WRITE = 2,
+    PERM_EXEC = 4,
+    PERM_ALL = PERM_READ | PERM_WRITE | PERM_EXEC,
   };
 
  private:
   std::string elf_file;
   std::vector<MemoryRegion> memory_regions;
 
+  // Execution limits (0 = no limit)
+  uint64_t max_instructions = 0;
+  double time_limit = 0;
+  uint64_t slice_instructions = 0;
+
+  // Harts, scheduled round-robin for a quantum of instructions each
+  unsigned harts = 1;
+  uint64_t quantum = 0;
+
+  // Skip (or stop) loops that spin without side effects
+  bool idle_detection = true;
+
+  // Translation cache warm-up
+  bool tb_warmup = false;
+  std::string tb_warmup_file;
+  std::string tb_profile_file;
+
   address_t length_string_to_numb(std::string len_str) {
     size_t suffix_idx;
     address_t len;
@@ -47,6 +78,50 @@ class Config {
     return len;
   }
 
+  // Permissions are a combination of r, w and x, e.g., "rx"
+  bool parse_permissions(std::string perm, uint8_t &permissions) {
+    if (perm.empty() || perm.find_first_not_of("rwx") != std::string::npos) {
+      return false;
+    }
+    permissions = 0;
+    if (perm.find('r') != std::string::npos) permissions |= PERM_READ;
+    if (perm.find('w') != std::string::npos) permissions |= PERM_WRITE;
+    if (perm.find('x') != std::string::npos) permissions |= PERM_EXEC;
+    return true;
+  }
+
+  // Options are a comma separated list, e.g., "volatile,rw"
+  bool parse_region_options(std::string options, MemoryRegion &mr) {
+    std::stringstream ss(options);
+    std::string option;
+    while (getline(ss, option, ',')) {
+      if (option == "volatile") {
+        mr.is_volatile = true;
+      } else if (option == "nonvolatile" || option == "nv") {
+        mr.is_volatile = false;
+      } else if (option == "hugepages") {
+        mr.huge_pages = true;
+      } else if (option == "sparse") {
+        mr.sparse = true;
+      } else if (option == "elf") {
+        mr.elf_permissions = true;
+      } else if (option.compare(0, 5, "file=") == 0) {
+        mr.file = option.substr(5);
+      } else if (parse_permissions(option, mr.permissions)) {
+        // Done
+      } else {
+        std::cerr << "Unknown memory region option: " << option << std::endl;
+        return false;
+      }
+    }
+
+    if (!mr.file.empty() && mr.is_volatile) {
+      std::cerr << "A file backed memory region can not be volatile" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
  public:
     //memseg.name = mr.name;
     //memseg.origin = stol(mr.origin, nullptr, 16);
@@ -55,16 +130,49 @@ class Config {
     // Store the elf file
     elf_file = args.vm["elf-file"].as<std::string>();
 
+    // Store the execution limits
+    max_instructions = args.vm["max-instructions"].as<uint64_t>();
+    time_limit = args.vm["time-limit"].as<double>();
+    slice_instructions = args.vm["slice-instructions"].as<uint64_t>();
+    if (slice_instructions == 0) {
+      std::cerr << "The slice size must be at least one instruction" << std::endl;
+      slice_instructions = 1;
+    }
+
+    // Store the hart settings
+    harts = args.vm["harts"].as<unsigned>();
+    if (harts == 0) {
+      std::cerr << "There must be at least one hart" << std::endl;
+      harts = 1;
+    }
+    quantum = args.vm["quantum"].as<uint64_t>();
+    if (quantum == 0) {
+      std::cerr << "The quantum must be at least one instruction" << std::endl;
+      quantum = 1;
+    }
+
+    idle_detection = !args.vm["no-idle-detection"].as<bool>();
+
+    // Store the translation cache settings
+    tb_warmup = args.vm["tb-warmup"].as<bool>();
+    if (args.vm.count("tb-warmup-file")) {
+      tb_warmup_file = args.vm["tb-warmup-file"].as<std::string>();
+    }
+    if (args.vm.count("tb-profile")) {
+      tb_profile_file = args.vm["tb-profile"].as<std::string>();
+    }
+
     // Store the memory regions
     std::vector<std::string> region_args =
         args.vm["memory-region"].as<std::vector<std::string> >();
     for (const auto &region : region_args) {
       // Tokenize the string and parse it
-      // Format: NAME:ORIGIN:LENGTH
+      // Format: NAME:ORIGIN:LENGTH[:OPTIONS]
       std::stringstream ss(region);
       std::string r_name;
       std::string r_origin;
       std::string r_length;
+      std::string r_options;
 
       auto has_error = [&]() -> bool {
         if (!ss.good()) {
@@ -84,18 +192,38 @@ class Config {
       if (has_error()) continue;
       getline(ss, r_length, ':');
 
+      // The options are optional
+      if (ss.good()) {
+        getline(ss, r_options);
+      }
+
       // Parse the substrings
       address_t origin = stol(r_origin, nullptr, 16);
       address_t length = length_string_to_numb(r_length);
 
+      MemoryRegion mr = MemoryRegion{.name=r_name, .origin=origin, .length=length, .is_volatile=false, .huge_pages=false, .file="", .permissions=PERM_ALL, .sparse=false, .elf_permissions=false};
+      if (!parse_region_options(r_options, mr)) {
+        std::cerr << "Error parsing memory region argument: " << region << std::endl;
+        continue;
+      }
+
       // Add the region
-      memory_regions.push_back(MemoryRegion{.name=r_name, .origin=origin, .length=length});
+      memory_regions.push_back(mr);
     }
   }
 
   ~Config() {}
 
   std::vector<MemoryRegion> &getMemoryRegions() { return memory_regions; }
+  uint64_t getMaxInstructions() { return max_instructions; }
+  double getTimeLimit() { return time_limit; }
+  uint64_t getSliceInstructions() { return slice_instructions; }
+  unsigned getHarts() { return harts; }
+  uint64_t getQuantum() { return quantum; }
+  bool getIdleDetection() { return idle_detection; }
+  bool getTbWarmup() { return tb_warmup; }
+  std::string &getTbWarmupFile() { return tb_warmup_file; }
+  std::string &getTbProfileFile() { return tb_profile_file; }
 
   void print() { std::cout << "Config settings:" << std::endl; }
 };
@@ -10,11 +10,12 @@
 #include "ArchitectureArmv7.h"
 #include "ArchitectureRiscv32.h"
 #include "ArchitectureRiscv64.h"
+#include "RegisterCache.h"
 
 namespace icemu {
 /*
  * Wrapper class that dynamically chooses the helpers from the correct architecture
- * TODO: Probably make an abstract base class somewhere to not have the switch-case.
+ * For code that is instantiated per architecture see TypedArchitecture below.
  */
 class Architecture {
  private:
@@ -29,6 +30,9 @@ class Architecture {
   ArchitectureRiscv32 arch_riscv32;
   ArchitectureRiscv64 arch_riscv64;
 
+  // Register values of the current hook event
+  RegisterCache register_cache_;
+
   // Map
 
  public:
@@ -37,10 +41,39 @@ class Architecture {
     arch_ = arch;
     uc_ = uc;
 
-    // Init the availible architectures
-    arch_armv7.init(uc);
-    arch_riscv32.init(uc);
-    arch_riscv64.init(uc);
+    // Only the emulated architecture is used
+    switch (arch_) {
+      case EMU_ARCH_ARMV7:
+        arch_armv7.init(uc, &register_cache_);
+        register_cache_.init(uc, arch_armv7.getCachedRegisters());
+        break;
+      case EMU_ARCH_RISCV32:
+        arch_riscv32.init(uc, &register_cache_);
+        register_cache_.init(uc, arch_riscv32.getCachedRegisters());
+        break;
+      case EMU_ARCH_RISCV64:
+        arch_riscv64.init(uc, &register_cache_);
+        register_cache_.init(uc, arch_riscv64.getCachedRegisters());
+        break;
+    }
+  }
+
+  // Act on another engine (i.e., the hart that runs next), references to
+  // this object and its backends stay valid
+  void setEngine(uc_engine *uc) {
+    uc_ = uc;
+    switch (arch_) {
+      case EMU_ARCH_ARMV7:
+        arch_armv7.init(uc, &register_cache_);
+        break;
+      case EMU_ARCH_RISCV32:
+        arch_riscv32.init(uc, &register_cache_);
+        break;
+      case EMU_ARCH_RISCV64:
+        arch_riscv64.init(uc, &register_cache_);
+        break;
+    }
+    register_cache_.setEngine(uc);
   }
 
   // Architecture
@@ -59,7 +92,7 @@ class Architecture {
     REG_SP
   };
 
-  ArchitectureArmv7::Register genericRegToArmv7Reg(Register reg) {
+  static ArchitectureArmv7::Register genericRegToArmv7Reg(Register reg) {
     switch (reg) {
       case REG_RETURN:
         return ArchitectureArmv7::REG_RETURN;
@@ -74,7 +107,7 @@ class Architecture {
     return ArchitectureArmv7::REG_PC; // Unreachable
   }
 
-  ArchitectureRiscv32::Register genericRegToRiscv32Reg(Register reg) {
+  static ArchitectureRiscv32::Register genericRegToRiscv32Reg(Register reg) {
     switch (reg) {
       case REG_RETURN:
         return ArchitectureRiscv32::REG_RETURN;
@@ -89,7 +122,7 @@ class Architecture {
     return ArchitectureRiscv32::REG_PC; // Unreachable
   }
 
-  ArchitectureRiscv64::Register genericRegToRiscv64Reg(Register reg) {
+  static ArchitectureRiscv64::Register genericRegToRiscv64Reg(Register reg) {
     switch (reg) {
       case REG_RETURN:
         return ArchitectureRiscv64::REG_RETURN;
@@ -145,8 +178,12 @@ class Architecture {
 
   void registerSet(Register reg, address_t value) {
     uc_reg_write(uc_, genericToArchReg(reg), &value);
+    register_cache_.invalidate();
   }
 
+  // Registers of the current hook event, fetched (once) on first use
+  inline RegisterCache &getRegisterCache() { return register_cache_; }
+
   // Function manipulation
   void functionSkip() {
     switch (arch_) {
@@ -229,6 +266,21 @@ class Architecture {
     assert(false && "Unknown architecture");
   }
 
+  address_t getStartAddress(address_t address) {
+    switch (arch_) {
+      case EMU_ARCH_ARMV7:
+        return arch_armv7.getStartAddress(address);
+        break;
+      case EMU_ARCH_RISCV32:
+        return arch_riscv32.getStartAddress(address);
+        break;
+      case EMU_ARCH_RISCV64:
+        return arch_riscv64.getStartAddress(address);
+        break;
+    }
+    assert(false && "Unknown architecture");
+  }
+
 #if 0 // is this needed?
   void reset() {
     switch (arch_) {
@@ -243,4 +295,88 @@ class Architecture {
   }
 #endif
 };
+
+/*
+ * Statically dispatched version of Architecture, e.g.,
+ *   TypedArchitecture<ArchitectureArmv7> arch(emu.getArchitecture());
+ * The helpers inline to direct unicorn calls (no switch on the architecture)
+ */
+template <class ArchImpl>
+struct ArchitectureTraits;
+
+template <>
+struct ArchitectureTraits<ArchitectureArmv7> {
+  static const Arch arch = EMU_ARCH_ARMV7;
+  static ArchitectureArmv7 &get(Architecture &a) { return a.getArmv7Architecture(); }
+  static ArchitectureArmv7::Register reg(Architecture::Register r) {
+    return Architecture::genericRegToArmv7Reg(r);
+  }
+};
+
+template <>
+struct ArchitectureTraits<ArchitectureRiscv32> {
+  static const Arch arch = EMU_ARCH_RISCV32;
+  static ArchitectureRiscv32 &get(Architecture &a) { return a.getRiscv32Architecture(); }
+  static ArchitectureRiscv32::Register reg(Architecture::Register r) {
+    return Architecture::genericRegToRiscv32Reg(r);
+  }
+};
+
+template <>
+struct ArchitectureTraits<ArchitectureRiscv64> {
+  static const Arch arch = EMU_ARCH_RISCV64;
+  static ArchitectureRiscv64 &get(Architecture &a) { return a.getRiscv64Architecture(); }
+  static ArchitectureRiscv64::Register reg(Architecture::Register r) {
+    return Architecture::genericRegToRiscv64Reg(r);
+  }
+};
+
+template <class ArchImpl>
+class TypedArchitecture {
+ private:
+  typedef ArchitectureTraits<ArchImpl> traits;
+
+  ArchImpl &impl_;
+
+ public:
+  typedef typename ArchImpl::addr_t addr_t;
+
+  explicit TypedArchitecture(Architecture &architecture)
+      : impl_(traits::get(architecture)) {
+    assert(architecture.getArch() == traits::arch && "Wrong typed architecture");
+  }
+
+  // The architecture specific helpers
+  inline ArchImpl &impl() { return impl_; }
+
+  inline Arch getArch() { return traits::arch; }
+  inline address_t getAddressSize() { return sizeof(addr_t); }
+
+  inline address_t registerGet(Architecture::Register reg) {
+    return impl_.registerGet(traits::reg(reg));
+  }
+
+  inline void registerSet(Architecture::Register reg, address_t value) {
+    impl_.registerSet(traits::reg(reg), (addr_t)value);
+  }
+
+  // Function manipulation
+  inline void functionSkip() { impl_.functionSkip(); }
+
+  template <typename T>
+  inline void functionSetReturn(T value) { impl_.functionSetReturn(value); }
+
+  inline address_t functionGetArgument(std::size_t n) {
+    return impl_.functionGetArgument(n);
+  }
+
+  inline address_t getFunctionAddress(address_t address) {
+    return impl_.getFunctionAddress(address);
+  }
+
+  inline address_t getStartAddress(address_t address) {
+    return impl_.getStartAddress(address);
+  }
+};
+
 }
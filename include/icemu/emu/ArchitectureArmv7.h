@@ -2,23 +2,28 @@
 
 #include <cstdint>
 #include <iostream>
+#include <vector>
 #include <assert.h>
 
 #include <unicorn/unicorn.h>
 
 #include "Arch.h"
+#include "RegisterCache.h"
 
 namespace icemu {
 
 class ArchitectureArmv7 {
  private:
    uc_engine *uc_ = nullptr;
+   RegisterCache *cache_ = nullptr;
 
  public:
   typedef uint32_t armv7_addr_t;
+  typedef armv7_addr_t addr_t;
 
-  void init(uc_engine *uc) {
+  void init(uc_engine *uc, RegisterCache *cache = nullptr) {
     uc_ = uc;
+    cache_ = cache;
   }
 
   inline Arch getArch() { return EMU_ARCH_ARMV7; }
@@ -58,6 +63,29 @@ class ArchitectureArmv7 {
 
   void registerSet(Register reg, armv7_addr_t value) {
     uc_reg_write(uc_, reg, &value);
+    if (cache_ != nullptr) {
+      cache_->invalidate();
+    }
+  }
+
+  // Batched versions, one call into unicorn for count registers
+  bool registerGet(const Register *regs, armv7_addr_t *values, int count) {
+    static_assert(sizeof(Register) == sizeof(int), "Register must be an int");
+    return registerReadBatch(uc_, (const int *)regs, values, count);
+  }
+
+  bool registerSet(const Register *regs, const armv7_addr_t *values, int count) {
+    if (cache_ != nullptr) {
+      cache_->invalidate();
+    }
+    return registerWriteBatch(uc_, (const int *)regs, values, count);
+  }
+
+  // Registers kept in the RegisterCache
+  std::vector<int> getCachedRegisters() {
+    return {REG_R0, REG_R1, REG_R2, REG_R3, REG_R4, REG_R5, REG_R6, REG_R7,
+            REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_SP, REG_LR, REG_PC,
+            REG_APSR};
   }
 
   // Function manipulation
@@ -106,5 +134,10 @@ class ArchitectureArmv7 {
     return address & ~0x1;
   }
 
+  // Address to (re)start execution from, we always execute Thumb code
+  armv7_addr_t getStartAddress(armv7_addr_t address) {
+    return address | 0x1;
+  }
+
   };
 }
@@ -2,23 +2,28 @@
 
 #include <cstdint>
 #include <iostream>
+#include <vector>
 #include <assert.h>
 
 #include <unicorn/unicorn.h>
 
 #include "Arch.h"
+#include "RegisterCache.h"
 
 namespace icemu {
 
 class ArchitectureRiscv64 {
  private:
    uc_engine *uc_ = nullptr;
+   RegisterCache *cache_ = nullptr;
 
  public:
   typedef uint64_t riscv_addr_t;
+  typedef riscv_addr_t addr_t;
 
-  void init(uc_engine *uc) {
+  void init(uc_engine *uc, RegisterCache *cache = nullptr) {
     uc_ = uc;
+    cache_ = cache;
   }
 
   inline Arch getArch() { return EMU_ARCH_RISCV64; }
@@ -77,6 +82,32 @@ class ArchitectureRiscv64 {
 
   void registerSet(Register reg, riscv_addr_t value) {
     uc_reg_write(uc_, reg, &value);
+    if (cache_ != nullptr) {
+      cache_->invalidate();
+    }
+  }
+
+  // Batched versions, one call into unicorn for count registers
+  bool registerGet(const Register *regs, riscv_addr_t *values, int count) {
+    static_assert(sizeof(Register) == sizeof(int), "Register must be an int");
+    return registerReadBatch(uc_, (const int *)regs, values, count);
+  }
+
+  bool registerSet(const Register *regs, const riscv_addr_t *values, int count) {
+    if (cache_ != nullptr) {
+      cache_->invalidate();
+    }
+    return registerWriteBatch(uc_, (const int *)regs, values, count);
+  }
+
+  // Registers kept in the RegisterCache
+  std::vector<int> getCachedRegisters() {
+    std::vector<int> regs;
+    for (int reg = REG_X0; reg <= REG_X31; reg++) {
+      regs.push_back(reg);
+    }
+    regs.push_back(REG_PC);
+    return regs;
   }
 
   // Function manipulation
@@ -131,5 +162,10 @@ class ArchitectureRiscv64 {
     return address;
   }
 
+  // Address to (re)start execution from
+  riscv_addr_t getStartAddress(riscv_addr_t address) {
+    return address;
+  }
+
 };
 }
@@ -1,9 +1,17 @@
 #ifndef ICEMU_EMU_EMULATOR_H_
 #define ICEMU_EMU_EMULATOR_H_
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 #include <assert.h>
 
 #include <capstone/capstone.h>
@@ -11,17 +19,26 @@
 
 #include "icemu/Config.h"
 #include "icemu/emu/Architecture.h"
+#include "icemu/emu/EventQueue.h"
 #include "icemu/emu/Memory.h"
+#include "icemu/emu/MemoryView.h"
+#include "icemu/emu/Snapshot.h"
 #include "icemu/hooks/HookManager.h"
 #include "icemu/plugin/PluginArguments.h"
 
 
 namespace icemu {
 
+class MmioDevice;
+
+// Set (e.g., by a signal handler) to stop the emulation at the next slice
+extern volatile std::atomic<bool> gStopEmulation;
+
 class Emulator {
  private:
   Config &cfg_;
   Memory &mem_;
+  MemoryView mem_view_;
 
   /* The emulated architecture */
   Arch arch_;
@@ -29,106 +46,300 @@ class Emulator {
   /* Plugin arguments */
   PluginArguments plugin_args;
 
+  // Helpers for the architecture, act on the engine of the current hart
   Architecture architecture;
   HookManager hook_manager;
 
-  /* Unicorn */
+  /* A hart, every hart has its own unicorn engine on the shared memory */
+  struct Hart {
+    uc_engine *uc = NULL;
+    uint64_t instructions = 0;  // Instructions executed in previous quanta
+    // Set when execution resumes after a slice, the block that was
+    // interrupted by the end of the slice was already reported to the hooks
+    bool resumed_block = false;
+    bool warmup_pending = false;
+    // Executed a wfi, the hart sleeps until the next event
+    bool waiting = false;
+    // Consecutive slices that ended in a loop without side effects (see
+    // probeIdle())
+    unsigned idle = 0;
+    address_t idle_pc = 0;      // PC at the end of the last slice
+    unsigned idle_skip = 0;     // Slices to go before probing again
+    unsigned idle_backoff = 1;
+    // Interrupt lines raised by the devices (see raiseInterrupt())
+    uint64_t pending_interrupts = 0;
+    // Cortex-M exception handlers entered and not returned from
+    unsigned exception_depth = 0;
+    // CPU state at the start of the run, used by reset()
+    Snapshot boot_snapshot;
+  };
+  std::vector<Hart> harts_;
+  unsigned current_hart_ = 0;
+
+  // Make id the current hart, uc and the architecture act on its engine
+  void switchHart(unsigned id);
+
+  /* Unicorn engine of the current hart */
   uc_engine *uc = NULL;
   /* Unicorn hooks */
   uc_hook uc_hook_code;
-  uc_hook uc_hook_memory;
+  uc_hook uc_hook_block;
+  uc_hook uc_hook_memory_read;
+  uc_hook uc_hook_memory_write;
+  uc_hook uc_hook_memory_prot;
+  uc_hook uc_hook_memory_unmapped;
+  uc_hook uc_hook_interrupt;
+  std::vector<uc_hook> uc_hooks_range;
 
   /* Capstone */
   csh cs;
 
+  /* Block start address -> (block size, instruction count) */
+  std::unordered_map<address_t, std::pair<address_t, address_t>> block_icount_cache;
+
   bool good_ = true;
 
+  /* Execution state */
+  bool running_ = false;
+  bool stop_requested_ = false;
+  uint64_t instructions_ = 0; // Instructions executed in previous slices
+  uint64_t time_ = 0;         // Same plus the time skipped while waiting
+  // Instructions of the blocks the current slice entered (see countBlock())
+  uint64_t slice_executed_ = 0;
+  uint64_t slice_count_ = 0;  // Instructions the current slice may execute
+  // The last block the current slice entered
+  address_t block_address_ = 0;
+  address_t block_size_ = 0;
+  // The current slice was cut short for an event (see cutSliceForEvents())
+  bool slice_cut_ = false;
+  address_t blockRemainder(address_t pc);
+
+  /* Events in emulated time */
+  EventQueue events_;
+  uint64_t waited_ = 0;  // Time skipped because all the harts waited (or idled)
+
+  // A hart executed a wfi, run() lets the other harts (or time) go on
+  bool pending_wait_ = false;
+
+  /* Idle loop detection */
+  // Slices that end within this distance of each other might spin in the
+  // same loop, the probe only steps through this window around its start
+  static const address_t idle_window = 64;
+  bool probing_ = false;
+  bool idle_side_effect_ = false;  // The probe saw an access that changes something
+  bool probeIdle(uint64_t max_steps);
+  bool isMmio(address_t address);
+
+  // A restore requested while unicorn is running is done after it stopped
+  Snapshot *pending_restore_ = nullptr;
+  bool restoreNow(Snapshot &snap);
+
+  // Same for a reset and a power failure
+  bool pending_reset_ = false;
+  bool pending_power_failure_ = false;
+  void resetNow();
+  void powerFailureNow();
+
+  /* Interrupts, taken by the current hart in between slices */
+  bool takeInterrupt();
+  bool takeRiscvInterrupt();
+  bool takeArmv7Exception();
+
+  // Drop the code all the harts translated from [begin, end)
+  void invalidateCode(address_t begin, address_t end);
+
+  /* Memory mapped devices (owned) */
+  std::vector<MmioDevice *> mmio_devices_;
+  bool mapMmioDevices();
+
+  /* Exit points (address -> stop reason), unicorn stops there by itself */
+  std::map<address_t, std::string> exit_points_;
+  bool installExitPoints();
+
+  /* Translation cache warm-up */
+  bool profiling_ = false;
+  std::unordered_set<address_t> profiled_blocks_;
+  uint64_t warmup_blocks_ = 0;
+  double warmup_time_ = 0;
+
+  address_t translateBlocks(address_t begin, address_t end);
+  void warmupTranslationCache();
+  void writeBlockProfile();
+
   // Register hooks in unicorn
   bool registerCodeHook();
+  bool registerBlockHook();
   bool registerMemoryHook();
+  bool registerProtectionHook();
+  bool registerUnmappedHook();
+  bool registerRangeHooks();
+  bool registerWaitHooks();
+  bool registerHartIdHooks();
+  bool registerInterruptHook();
 
- public:
-
-  Emulator(Arch arch, Config &cfg, Memory &mem) : cfg_(cfg), mem_(mem) {
-    /* Set the emulator architecture */
-    arch_ = arch;
-
-    uc_err err;
-
-    /*
-     * Initialize the correct core and capstone engine
-     */
-    switch (arch_) {
-      case EMU_ARCH_ARMV7:
-        err = uc_open(UC_ARCH_ARM, (uc_mode)(UC_MODE_THUMB | UC_MODE_MCLASS), &uc);
-        if (cs_open(CS_ARCH_ARM, (cs_mode)(CS_MODE_THUMB | CS_MODE_MCLASS), &cs) !=
-            CS_ERR_OK) {
-          std::cerr << "Failed to initialize capstone engine" << std::endl;
-          good_ = false;
-          assert(false);
-        }
-        break;
-
-      case EMU_ARCH_RISCV32:
-        err = uc_open(UC_ARCH_RISCV, (uc_mode)(UC_MODE_RISCV32), &uc);
-        if (cs_open(CS_ARCH_RISCV, (cs_mode)(CS_MODE_RISCV32 | CS_MODE_RISCVC), &cs) !=
-            CS_ERR_OK) {
-          std::cerr << "Failed to initialize capstone engine" << std::endl;
-          good_ = false;
-          assert(false);
-        }
-        break;
-
-      case EMU_ARCH_RISCV64:
-        err = uc_open(UC_ARCH_RISCV, (uc_mode)(UC_MODE_RISCV64), &uc);
-        if (cs_open(CS_ARCH_RISCV, (cs_mode)(CS_MODE_RISCV64 | CS_MODE_RISCVC), &cs) !=
-            CS_ERR_OK) {
-          std::cerr << "Failed to initialize capstone engine" << std::endl;
-          good_ = false;
-          assert(false);
-        }
-        break;
-
-      default:
-        std::cerr << "Unknown architecture" << std::endl;
-        good_ = false;
-    }
+  /* Flush the buffered output of the plugins */
+  std::vector<std::function<void()>> flush_callbacks_;
+  void flushOutput();
 
-    if (err) {
-      std::cerr << "Failed to create uc with error" << std::endl;
-      good_ = false;
-    }
+  /* Plugin state that starts over on a reset (or power failure) */
+  std::vector<std::function<void()>> reset_callbacks_;
 
-    /* Initialize capstone engine */
-    cs_option(cs, CS_OPT_DETAIL, CS_OPT_ON);
+ public:
 
-    /* Initialize the emulator architecture */
-    architecture.init(arch_, uc);
-  }
+  Emulator(Arch arch, Config &cfg, Memory &mem);
 
-  ~Emulator() {
-    uc_close(uc);
-    cs_close(&cs);
-  }
+  ~Emulator();
 
   bool init();
+  // Run all the harts, round-robin for --quantum instructions each
   bool run();
   void stop(std::string reason="unspecified");
+  // Reset all the harts
   void reset();
-
+  // Reset the CPU and the content of the volatile memory, only the volatile
+  // pages written since the last power failure are restored
+  void powerFailure();
+
+  // Capture the CPU state (of the current hart, with its pending interrupts
+  // and exception handlers) and (optionally) the content of all the memory
+  Snapshot snapshot(bool with_memory = true);
+  // Restore a snapshot, only the pages written since the snapshot are copied
+  // back. When called from a hook the restore happens as soon as the current
+  // instruction finished (the snapshot must outlive that)
+  bool restore(Snapshot &snap);
+
+  // Stop the emulation when execution reaches address, this costs nothing
+  // per instruction (must be called before run())
+  void addExitPoint(address_t address, std::string reason);
+  bool addExitPoint(std::string symbol_name);
+  // Add an exit point at every breakpoint instruction (bkpt #0 / ebreak) in
+  // the executable segments, returns the number found
+  size_t addBreakpointExitPoints();
+
+  // Map a device, only accesses to its window leave the JIT. The emulator
+  // takes ownership (must be called before registerHooks())
+  void addMmioDevice(MmioDevice *device);
+
+  // Called to flush buffered (guest) output before the emulator prints why it
+  // stops and when the run ends, so the output stays in order
+  void addFlushCallback(std::function<void()> callback);
+
+  // Called when the CPUs are reset (or lose power), for the state of plugins
+  // that are not a device (see MmioDevice::reset())
+  void addResetCallback(std::function<void()> callback);
+
+  // Install the unicorn hooks, must be called after all the hooks are added
+  // to the HookManager (i.e., after the plugins are registered)
   bool registerHooks();
 
+  // Emulated time, i.e., the instructions executed by all the harts plus the
+  // time skipped while they waited for an interrupt. Exact between slices
+  // (e.g., in events), in a hook the current block counts as a whole.
+  inline uint64_t getTime() {
+    return running_ ? time_ + std::min(slice_executed_, slice_count_) : time_;
+  }
+
+  // Instructions executed by all the harts, like getTime() without the time
+  // skipped while waiting
+  inline uint64_t getInstructionCount() {
+    return running_ ? instructions_ + std::min(slice_executed_, slice_count_) : instructions_;
+  }
+
+  // Schedule events at a time (see getTime())
+  inline EventQueue &getEventQueue() { return events_; }
+
+  // The current hart executes a wait for interrupt at address, it sleeps
+  // until the next event (used by the wfi hooks)
+  void waitForInterrupt(address_t address, address_t size);
+
+  // Raise or clear an interrupt line of a hart, for RISC-V the line is the
+  // interrupt cause (e.g., 7 for the machine timer), for Cortex-M the
+  // exception number (e.g., 15 for SysTick). The hart takes the interrupt in
+  // between slices once it is enabled, a waiting hart wakes up. A RISC-V
+  // interrupt is level triggered (pending until the device clears it), a
+  // Cortex-M exception is pending until it is taken.
+  void raiseInterrupt(unsigned hart, unsigned line);
+  void clearInterrupt(unsigned hart, unsigned line);
+
+  // The current hart reads mhartid with the csrr at address (used by the
+  // mhartid hooks)
+  void readHartId(address_t address);
+
+  // The current hart trapped with exception intno at address, true if it
+  // was a Cortex-M exception return (used by the interrupt hook)
+  bool exceptionReturn(uint32_t intno, address_t address);
+
+  // A write while probing for an idle loop (used by the probe hook)
+  void idleProbeWrite(address_t address, address_t size, uint64_t value);
+  // A device read while probing for an idle loop (used by the device window)
+  void idleProbeRead(MmioDevice *device, address_t address);
+
+  // A device was accessed, end the slice if it scheduled an event before
+  // the end of the slice (used by the device window)
+  void cutSliceForEvents();
+
+  // A block starts executing, count its instructions for the current slice
+  // (used by the block hook). Returns the instructions in the block.
+  inline address_t countBlock(address_t address, address_t size) {
+    address_t icount = getBlockInstructionCount(address, size);
+    slice_executed_ += icount;
+    block_address_ = address;
+    block_size_ = size;
+    return icount;
+  }
+
+  // Remember the executed blocks for --tb-profile
+  inline void profileBlock(address_t address) {
+    if (profiling_) {
+      profiled_blocks_.insert(address);
+    }
+  }
+
+  // True (once) if the current block continues a block interrupted by the
+  // end of a slice
+  inline bool consumeResumedBlock() {
+    bool resumed = harts_[current_hart_].resumed_block;
+    harts_[current_hart_].resumed_block = false;
+    return resumed;
+  }
+
+  // A new hook event starts, registers fetched for the previous one are stale
+  inline RegisterCache *newEventRegisters() {
+    RegisterCache &cache = architecture.getRegisterCache();
+    cache.invalidate();
+    return &cache;
+  }
+
   bool good() { return good_; }
   bool bad() { return !good_; }
 
+  // Map the chunk of a sparse segment that contains address (up to the
+  // device windows), false if the address is not part of a sparse segment.
+  // True if the chunk was already mapped.
+  bool mapSparse(address_t address);
+
+  // Read through unicorn, prefer getMemoryView() which reads the host
+  // backing directly
   bool readMemory(address_t address, char *restult, address_t size);
 
+  // Number of instructions in the block at address (of size bytes)
+  address_t getBlockInstructionCount(address_t address, address_t size);
+
+  // The hart that is running (or ran last), hooks run on this hart
+  inline unsigned getHartId() { return current_hart_; }
+  inline unsigned getHartCount() { return (unsigned)harts_.size(); }
+  // Instructions the hart executed in previous quanta
+  inline uint64_t getHartInstructions(unsigned id) { return harts_[id].instructions; }
+
   // Getters
   inline Arch getArch() { return arch_; }
+  // Acts on the current hart
   inline Architecture &getArchitecture() { return architecture; }
   inline Memory &getMemory() { return mem_; }
+  inline MemoryView &getMemoryView() { return mem_view_; }
   inline HookManager &getHookManager() { return hook_manager; }
   inline Config &getConfig() { return cfg_; }
+  // Engine of the current hart
   inline uc_engine *getUnicornEngine() { return uc; }
   inline csh *getCapstoneEngine() { return &cs; }
   inline PluginArguments &getPluginArguments() { return plugin_args; };
@@ -0,0 +1,86 @@
+#ifndef ICEMU_EMU_EVENTQUEUE_H_
+#define ICEMU_EMU_EVENTQUEUE_H_
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace icemu {
+
+/*
+ * Events at a point in emulated time (see Emulator::getTime()). The emulator
+ * ends a slice when the next event is due, so a pending event costs nothing
+ * while the code runs. Events due at the same time run in the order they
+ * were scheduled.
+ */
+class EventQueue {
+ public:
+  typedef uint64_t event_id_t;
+  typedef std::function<void()> callback_t;
+
+  static const uint64_t never = std::numeric_limits<uint64_t>::max();
+
+ private:
+  struct Event {
+    uint64_t time;
+    event_id_t id;
+    std::string name;
+    callback_t callback;
+
+    bool operator>(const Event &other) const {
+      return time != other.time ? time > other.time : id > other.id;
+    }
+  };
+
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> queue_;
+  std::unordered_set<event_id_t> pending_;  // Not run and not cancelled
+  event_id_t next_id_ = 1;
+
+  // Drop cancelled events from the top
+  void dropCancelled() {
+    while (!queue_.empty() && pending_.count(queue_.top().id) == 0) {
+      queue_.pop();
+    }
+  }
+
+ public:
+  event_id_t schedule(uint64_t time, std::string name, callback_t callback) {
+    event_id_t id = next_id_++;
+    queue_.push(Event{time, id, name, callback});
+    pending_.insert(id);
+    return id;
+  }
+
+  // Returns false if the event already ran (or was cancelled)
+  bool cancel(event_id_t id) { return pending_.erase(id) != 0; }
+
+  bool empty() { return pending_.empty(); }
+
+  // Time of the next event, never if there is none
+  uint64_t nextTime() {
+    dropCancelled();
+    return queue_.empty() ? never : queue_.top().time;
+  }
+
+  // Run the events due at time, including the ones they schedule for (up
+  // to) time. Returns the number of events that ran.
+  size_t runDue(uint64_t time) {
+    size_t ran = 0;
+    while (nextTime() <= time) {
+      Event event = queue_.top();
+      queue_.pop();
+      pending_.erase(event.id);
+      event.callback();
+      ++ran;
+    }
+    return ran;
+  }
+};
+
+}  // namespace icemu
+
+#endif /* ICEMU_EMU_EVENTQUEUE_H_ */
@@ -4,9 +4,11 @@
 #include <cstdint>
 #include <list>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
-
-#include "elfio/elfio.hpp"
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "icemu/emu/types.h"
 #include "icemu/Config.h"
@@ -18,7 +20,9 @@ typedef struct memload {
   address_t origin;
   address_t length;
 
-  uint8_t *data = NULL;
+  const uint8_t *data = NULL;  // Points into the (mapped) elf file
+  bool executable = false;
+  uint8_t permissions = Config::PERM_ALL;  // Of the elf segment
 } memload_t;
 
 typedef struct memseg {
@@ -30,6 +34,32 @@ typedef struct memseg {
 
   size_t allocated_length;
   uint8_t *data = NULL;  // the content (allocated) for this segment
+
+  uint8_t permissions = Config::PERM_ALL;
+
+  // A sparse segment is mapped in the emulator on first access (in chunks)
+  bool sparse = false;
+
+  // The pages of the elf segments get the permissions of the segment (e.g.,
+  // rx for the code), the rest rw (always within permissions)
+  bool elf_permissions = false;
+
+  // Volatile memory loses its content on a power failure
+  bool is_volatile = false;
+  bool huge_pages = false;
+
+  // Persistent memory backed by a (shared) host file, it is only loaded
+  // from the elf file if the file did not exist yet
+  std::string file;
+  bool file_populate = false;
+  // One entry per page, set on the first write to the page since the last
+  // power failure (only tracked for volatile segments)
+  std::vector<uint8_t> dirty;
+  // One entry per page while the writes are tracked: the write epoch in
+  // which the page was last written (0 if not since tracking started) and
+  // whether it is writable (i.e., not write protected)
+  std::vector<uint32_t> written;
+  std::vector<uint8_t> writable;
 } memseg_t;
 
 class Memory {
@@ -38,12 +68,36 @@ class Memory {
   std::string elf_file_;
   Config &cfg_;
 
+  bool tracking_dirty_ = false;
+  uint32_t write_epoch_ = 1;
+
+  // The elf file mapped read-only
+  int elf_fd_ = -1;
+  const uint8_t *elf_data_ = nullptr;
+  size_t elf_size_ = 0;
+
+  bool mapElf();
+  bool inElf(uint64_t offset, uint64_t size);
+  size_t mapElfPages(memseg_t &m, const memload_t &ml);
+  void *mapFile(memseg_t &m);
+  template <typename Ehdr, typename Phdr, typename Shdr, typename Sym>
+  bool collectElf();
+
   size_t map_segment_to_memory(address_t *origin, address_t *length);
   bool collect();
   bool allocate();
 
+  // Address to segment lookup, the address space is split in chunks and
+  // every chunk lists the (few) segments that overlap it
+  static const unsigned chunk_shift = 20;
+  std::unordered_map<address_t, std::vector<size_t>> chunk_index_;
+  void buildIndex();
+  bool protectPage(memseg_t &m, size_t page, bool writable);
+
  public:
-  ELFIO::elfio elf_reader;
+  // Unicorn maps memory in pages of this size
+  static const size_t page_size = 4096;
+
   std::vector<memseg_t> memory;
   Symbols symbols;
   address_t entrypoint = 0;
@@ -56,22 +110,54 @@ class Memory {
     if (good_) {
       good_ = allocate();
     }
+    buildIndex();
   }
 
   ~Memory() {
+    stopDirtyTracking();
+
     // Delete the allocate data
     for (const auto &m : memory) {
-      delete[] m.data;
-      for (const auto &ml : m.memload) {
-        delete[] ml.data;
+      if (m.data != NULL) {
+        munmap(m.data, m.allocated_length);
       }
     }
+
+    if (elf_data_ != nullptr) {
+      munmap((void *)elf_data_, elf_size_);
+    }
+    if (elf_fd_ >= 0) {
+      close(elf_fd_);
+    }
   }
 
   void populate();
+
+  // Track the pages written in the segments, the segments are write
+  // protected and the first write to a page (by the emulated code or the
+  // host) marks it dirty and unprotects it
+  bool startDirtyTracking();
+  void stopDirtyTracking();
+  inline bool trackingDirty() { return tracking_dirty_; }
+  // Called from the SIGSEGV handler, true if the address is a tracked page
+  bool markDirty(const void *host_address);
+  // Restore the initial (populated) content of the dirty volatile pages,
+  // returns the emulated address of every restored page
+  std::vector<address_t> resetVolatile();
+
+  // Start a new write epoch (e.g., for a snapshot), all the pages are write
+  // protected again. Returns the new epoch, 0 if writes are not tracked.
+  uint32_t startWriteEpoch();
+  // The pages written since the start of epoch, as (segment index, page)
+  std::vector<std::pair<size_t, size_t>> writtenSince(uint32_t epoch);
+
   memseg_t *find(std::string memseg_name);
   memseg_t *find(address_t address);
+  // Host pointer for an address, nullptr if the address is not mapped
   char *at(address_t address);
+  // Same, but the complete range [address, address + size) must be mapped
+  // by the same segment
+  char *at(address_t address, address_t size);
 
   Symbols &getSymbols() { return symbols; }
 
@@ -0,0 +1,125 @@
+#ifndef ICEMU_EMU_MEMORYVIEW_H_
+#define ICEMU_EMU_MEMORYVIEW_H_
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "icemu/emu/types.h"
+#include "icemu/emu/Memory.h"
+
+namespace icemu {
+
+/*
+ * A piece of guest memory, points straight into the host backing of a
+ * memory segment (no copy). Writes through the span are seen by the guest.
+ * It is empty if the range is not completely mapped by one segment.
+ */
+class MemorySpan {
+ private:
+  address_t address_ = 0;
+  uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+
+ public:
+  MemorySpan() {}
+  MemorySpan(address_t address, uint8_t *data, size_t size)
+      : address_(address), data_(data), size_(size) {}
+
+  bool empty() const { return data_ == nullptr; }
+  explicit operator bool() const { return !empty(); }
+
+  address_t address() const { return address_; }
+  uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  uint8_t *begin() const { return data_; }
+  uint8_t *end() const { return data_ + size_; }
+  uint8_t &operator[](size_t i) const { return data_[i]; }
+};
+
+/*
+ * Bounds-checked access to the guest memory through the host backing, so
+ * (hot) plugins don't need a round-trip through unicorn
+ */
+class MemoryView {
+ private:
+  Memory &mem_;
+
+ public:
+  explicit MemoryView(Memory &mem) : mem_(mem) {}
+
+  // Contiguous memory in one segment
+  MemorySpan span(address_t address, address_t size) {
+    char *data = mem_.at(address, size);
+    if (data == nullptr) {
+      return MemorySpan();
+    }
+    return MemorySpan(address, (uint8_t *)data, size);
+  }
+
+  // Copy memory that may cross segments, false if any byte is not mapped
+  bool read(address_t address, void *result, address_t size) {
+    uint8_t *dst = (uint8_t *)result;
+    while (size) {
+      memseg_t *m = mem_.find(address);
+      if (m == nullptr) {
+        return false;
+      }
+      address_t len = m->origin + m->length - address;
+      if (len > size) {
+        len = size;
+      }
+      memcpy(dst, &m->data[address - m->origin], len);
+      dst += len;
+      address += len;
+      size -= len;
+    }
+    return true;
+  }
+
+  // Same for a write, NB. unicorn does not see the write so code it already
+  // translated from this memory is not invalidated
+  bool write(address_t address, const void *value, address_t size) {
+    const uint8_t *src = (const uint8_t *)value;
+    while (size) {
+      memseg_t *m = mem_.find(address);
+      if (m == nullptr) {
+        return false;
+      }
+      address_t len = m->origin + m->length - address;
+      if (len > size) {
+        len = size;
+      }
+      memcpy(&m->data[address - m->origin], src, len);
+      src += len;
+      address += len;
+      size -= len;
+    }
+    return true;
+  }
+
+  // Load a value (guest memory is little endian, like the host)
+  template <typename T>
+  bool load(address_t address, T &value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Can only load trivially copyable types");
+    MemorySpan s = span(address, sizeof(T));
+    if (s) {
+      memcpy(&value, s.data(), sizeof(T));
+      return true;
+    }
+    return read(address, &value, sizeof(T));
+  }
+
+  template <typename T>
+  bool store(address_t address, const T &value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Can only store trivially copyable types");
+    return write(address, &value, sizeof(T));
+  }
+};
+
+}  // namespace icemu
+
+#endif /* ICEMU_EMU_MEMORYVIEW_H_ */
@@ -0,0 +1,75 @@
+#ifndef ICEMU_EMU_MMIODEVICE_H_
+#define ICEMU_EMU_MMIODEVICE_H_
+
+#include <cstdint>
+#include <string>
+
+#include "icemu/emu/types.h"
+#include "icemu/emu/Emulator.h"
+
+namespace icemu {
+
+/*
+ * A memory mapped device, unicorn only leaves the JIT for accesses to the
+ * device window (see Emulator::addMmioDevice). The window is rounded to
+ * whole pages, addresses passed to read() and write() are absolute.
+ *
+ * By default an access goes to the memory backing the window, so a device
+ * only has to handle its own registers and the rest of the window (e.g.,
+ * other variables in the same page) keeps behaving like plain memory.
+ */
+class MmioDevice {
+ private:
+  Emulator &emu_;
+
+ public:
+  std::string name;
+  address_t base;
+  address_t size;
+
+  MmioDevice(Emulator &emu, std::string devname, address_t devbase, address_t devsize)
+      : emu_(emu), name(devname), base(devbase), size(devsize) {}
+
+  virtual ~MmioDevice() = default;
+
+  inline Emulator &getEmulator() { return emu_; }
+
+  // First address of the (page aligned) window
+  inline address_t getWindowBase() {
+    return base & ~(address_t)(Memory::page_size - 1);
+  }
+
+  virtual uint64_t read(address_t address, unsigned access_size) {
+    return readBacking(address, access_size);
+  }
+
+  virtual void write(address_t address, unsigned access_size, uint64_t value) {
+    writeBacking(address, access_size, value);
+  }
+
+  // A read of the register at address can return something else later on
+  // without any write (e.g., a timer count), a loop that polls it is not idle
+  virtual bool readDependsOnTime(address_t address) {
+    (void)address;
+    return false;
+  }
+
+  // The CPUs are reset (or lose power), the backing memory is handled by the
+  // emulator
+  virtual void reset() {}
+
+ protected:
+  uint64_t readBacking(address_t address, unsigned access_size) {
+    uint64_t value = 0;
+    emu_.getMemoryView().read(address, &value, access_size);
+    return value;
+  }
+
+  void writeBacking(address_t address, unsigned access_size, uint64_t value) {
+    emu_.getMemoryView().write(address, &value, access_size);
+  }
+};
+
+}  // namespace icemu
+
+#endif /* ICEMU_EMU_MMIODEVICE_H_ */
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <unicorn/unicorn.h>
+
+#include "icemu/emu/types.h"
+
+namespace icemu {
+
+// Read several registers with one call into unicorn
+template <typename T>
+inline bool registerReadBatch(uc_engine *uc, const int *regs, T *values, int count) {
+  std::vector<void *> ptrs(count);
+  for (int i = 0; i < count; i++) {
+    values[i] = 0;  // Registers smaller than T are zero extended
+    ptrs[i] = &values[i];
+  }
+  return uc_reg_read_batch(uc, const_cast<int *>(regs), ptrs.data(), count) == UC_ERR_OK;
+}
+
+// Write several registers with one call into unicorn
+template <typename T>
+inline bool registerWriteBatch(uc_engine *uc, const int *regs, const T *values, int count) {
+  std::vector<void *> ptrs(count);
+  for (int i = 0; i < count; i++) {
+    ptrs[i] = const_cast<T *>(&values[i]);
+  }
+  return uc_reg_write_batch(uc, const_cast<int *>(regs), ptrs.data(), count) == UC_ERR_OK;
+}
+
+/*
+ * Register values for the current hook event. A register is read from
+ * unicorn the first time a hook asks for it in an event, so the hooks that
+ * look at the same event share one read and registers nobody asks for cost
+ * nothing. The cache is invalidated at every event and on every register
+ * write.
+ */
+class RegisterCache {
+ private:
+  uc_engine *uc_ = nullptr;
+
+  std::vector<int> regs_;          // Cached unicorn registers
+  std::vector<address_t> values_;  // Their values
+  std::vector<uint32_t> read_in_;  // Event in which the value was read
+  std::vector<int> slot_;          // Unicorn register -> index, -1 if not cached
+  uint32_t event_ = 1;
+
+  inline int slot(int reg) {
+    if (reg < 0 || (size_t)reg >= slot_.size()) {
+      return -1;
+    }
+    return slot_[reg];
+  }
+
+ public:
+  void init(uc_engine *uc, const std::vector<int> &regs) {
+    uc_ = uc;
+    regs_ = regs;
+    values_.assign(regs_.size(), 0);
+    read_in_.assign(regs_.size(), 0);
+    slot_.clear();
+    for (size_t i = 0; i < regs_.size(); i++) {
+      if ((size_t)regs_[i] >= slot_.size()) {
+        slot_.resize(regs_[i] + 1, -1);
+      }
+      slot_[regs_[i]] = (int)i;
+    }
+    invalidate();
+  }
+
+  // Cache the registers of another engine (i.e., another hart)
+  inline void setEngine(uc_engine *uc) {
+    uc_ = uc;
+    invalidate();
+  }
+
+  inline void invalidate() {
+    // Start over when the event counter wraps
+    if (++event_ == 0) {
+      std::fill(read_in_.begin(), read_in_.end(), 0);
+      event_ = 1;
+    }
+  }
+
+  // All the cached registers (in the order passed to init()), the ones not
+  // read yet in this event are read with one batched call
+  const std::vector<address_t> &getAll() {
+    std::vector<int> regs;
+    std::vector<size_t> slots;
+    for (size_t i = 0; i < regs_.size(); i++) {
+      if (read_in_[i] != event_) {
+        regs.push_back(regs_[i]);
+        slots.push_back(i);
+      }
+    }
+    if (regs.empty()) {
+      return values_;
+    }
+
+    std::vector<address_t> values(regs.size());
+    if (!registerReadBatch(uc_, regs.data(), values.data(), (int)regs.size())) {
+      std::fill(values.begin(), values.end(), 0);
+    }
+    for (size_t i = 0; i < slots.size(); i++) {
+      values_[slots[i]] = values[i];
+      read_in_[slots[i]] = event_;
+    }
+    return values_;
+  }
+
+  address_t get(int reg) {
+    int s = slot(reg);
+    if (s >= 0 && read_in_[s] == event_) {
+      return values_[s];
+    }
+
+    address_t value = 0;  // Registers smaller than address_t are zero extended
+    uc_reg_read(uc_, reg, &value);
+    if (s >= 0) {
+      values_[s] = value;
+      read_in_[s] = event_;
+    }
+    return value;
+  }
+
+  void set(int reg, address_t value) {
+    uc_reg_write(uc_, reg, &value);
+
+    // Read it back when asked, unicorn might not store the value as is
+    // (e.g., the Thumb bit of the PC)
+    int s = slot(reg);
+    if (s >= 0) {
+      read_in_[s] = 0;
+    }
+  }
+};
+
+}  // namespace icemu
@@ -0,0 +1,66 @@
+#ifndef ICEMU_EMU_SNAPSHOT_H_
+#define ICEMU_EMU_SNAPSHOT_H_
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <unicorn/unicorn.h>
+
+namespace icemu {
+
+/*
+ * Emulator state captured by Emulator::snapshot()
+ * Holds the CPU state (unicorn context and the interrupt state the emulator
+ * keeps for the hart) and optionally a copy of the content of every memory
+ * segment (same order as Memory::memory).
+ */
+class Snapshot {
+ public:
+  uc_context *context = nullptr;
+  std::vector<std::vector<uint8_t>> memory;
+  // Write epoch started with the snapshot, a restore only copies the pages
+  // written since (0 if the writes are not tracked)
+  uint32_t write_epoch = 0;
+  // Interrupt lines raised and Cortex-M handlers entered (see Emulator::Hart)
+  uint64_t pending_interrupts = 0;
+  unsigned exception_depth = 0;
+
+  Snapshot() = default;
+
+  // A unicorn context can only be freed once
+  Snapshot(const Snapshot &) = delete;
+  Snapshot &operator=(const Snapshot &) = delete;
+
+  Snapshot(Snapshot &&other)
+      : context(other.context), memory(std::move(other.memory)),
+        write_epoch(other.write_epoch), pending_interrupts(other.pending_interrupts),
+        exception_depth(other.exception_depth) {
+    other.context = nullptr;
+  }
+
+  Snapshot &operator=(Snapshot &&other) {
+    if (this != &other) {
+      if (context != nullptr) uc_context_free(context);
+      context = other.context;
+      memory = std::move(other.memory);
+      write_epoch = other.write_epoch;
+      pending_interrupts = other.pending_interrupts;
+      exception_depth = other.exception_depth;
+      other.context = nullptr;
+    }
+    return *this;
+  }
+
+  ~Snapshot() {
+    if (context != nullptr) uc_context_free(context);
+  }
+
+  inline bool good() const { return context != nullptr; }
+  inline bool bad() const { return context == nullptr; }
+  inline bool hasMemory() const { return !memory.empty(); }
+};
+
+}  // namespace icemu
+
+#endif /* ICEMU_EMU_SNAPSHOT_H_ */
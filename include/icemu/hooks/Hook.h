@@ -8,6 +8,7 @@
 namespace icemu {
 
 class Emulator;
+class RegisterCache;
 
 // Base class
 class Hook {
@@ -34,6 +35,10 @@ class Hook {
   struct hook_arg {
     address_t address;
     address_t size;
+    // Register values at this event, shared between all the hooks
+    RegisterCache *registers = nullptr;
+    // Hart that caused the event
+    unsigned hart = 0;
   };
 
   std::string name;
@@ -0,0 +1,27 @@
+#ifndef ICEMU_HOOKS_HOOKBLOCK_H_
+#define ICEMU_HOOKS_HOOKBLOCK_H_
+
+#include "icemu/emu/types.h"
+#include "icemu/hooks/Hook.h"
+
+namespace icemu {
+
+/*
+ * Called once every time a translated (basic) block is entered.
+ * NB. The instruction count is for the whole block, if execution leaves the
+ * block early (e.g., a hook changes the PC) the remaining instructions are
+ * still counted.
+ */
+class HookBlock : public Hook {
+  using Hook::Hook;  // Inherit constructor
+
+ public:
+  typedef struct hook_block_arg : hook_arg {
+    address_t icount;  // Number of instructions in the block
+  } hook_arg_t;
+
+  virtual void run(hook_arg_t *arg) = 0;
+};
+}  // namespace icemu
+
+#endif /* ICEMU_HOOKS_HOOKBLOCK_H_ */
@@ -0,0 +1,31 @@
+#ifndef ICEMU_HOOKS_HOOKINTERRUPT_H_
+#define ICEMU_HOOKS_HOOKINTERRUPT_H_
+
+#include <cstdint>
+
+#include "icemu/emu/types.h"
+#include "icemu/hooks/Hook.h"
+
+namespace icemu {
+
+/*
+ * Called when the code raises an exception that unicorn does not handle
+ * itself, e.g., a bkpt or svc on ARM and an ecall on RISC-V. Only the
+ * trapping instruction pays, nothing is done for the other instructions.
+ * The address is the PC, which for these points to the trapping
+ * instruction (the hook must move it past it).
+ */
+class HookInterrupt : public Hook {
+  using Hook::Hook;  // Inherit constructor
+
+ public:
+  typedef struct hook_interrupt_arg : hook_arg {
+    uint32_t intno;        // Exception number (see the unicorn/qemu target)
+    bool handled = false;  // Set by the hook that handled the exception
+  } hook_arg_t;
+
+  virtual void run(hook_arg_t *arg) = 0;
+};
+}  // namespace icemu
+
+#endif /* ICEMU_HOOKS_HOOKINTERRUPT_H_ */
@@ -8,8 +8,10 @@
 #include "icemu/emu/types.h"
 #include "icemu/hooks/Hook.h"
 #include "icemu/hooks/HookCode.h"
+#include "icemu/hooks/HookBlock.h"
 #include "icemu/hooks/HookMemory.h"
 #include "icemu/hooks/HookAllEvents.h"
+#include "icemu/hooks/HookInterrupt.h"
 #include "icemu/hooks/Hooks.h"
 
 namespace icemu {
@@ -19,6 +21,12 @@ class HookManager {
   Hooks<HookCode> hooks_code_;
   Hooks<HookMemory> hooks_memory_;
   Hooks<HookAllEvents> hooks_all_events_;
+  Hooks<HookBlock> hooks_block_;
+  Hooks<HookInterrupt> hooks_interrupt_;
+
+  // Range hooks get their own unicorn hook (only called for their range)
+  std::list<HookCode *> hooks_code_range_;
+  std::list<HookMemory *> hooks_memory_range_;
 
   // Used for easy cleanup
   std::list<Hook *> hooks_all;
@@ -40,14 +48,29 @@ class HookManager {
     //std::cout << "Hook Builder adding code hook: " << hook->name
     //          << " addr: " << hook << std::endl;
     track_hook(hook);
-    hooks_code_.add(hook);
+    if (hook->getType() == Hook::TYPE_RANGE) {
+      hooks_code_range_.push_back(hook);
+    } else {
+      hooks_code_.add(hook);
+    }
   }
 
   void add(HookMemory *hook) {
     //std::cout << "Hook Builder adding memory hook: " << hook->name
     //          << " addr: " << hook << std::endl;
     track_hook(hook);
-    hooks_memory_.add(hook);
+    if (hook->getType() == Hook::TYPE_RANGE) {
+      hooks_memory_range_.push_back(hook);
+    } else {
+      hooks_memory_.add(hook);
+    }
+  }
+
+  void add(HookBlock *hook) {
+    //std::cout << "Hook Builder adding block hook: " << hook->name
+    //          << " addr: " << hook << std::endl;
+    track_hook(hook);
+    hooks_block_.add(hook);
   }
 
   void add(HookAllEvents *hook) {
@@ -57,6 +80,21 @@ class HookManager {
     hooks_all_events_.add(hook);
   }
 
+  void add(HookInterrupt *hook) {
+    track_hook(hook);
+    hooks_interrupt_.add(hook);
+  }
+
+  // Used by the emulator to only install the unicorn hooks that are needed
+  inline bool hasCodeHooks() const { return !hooks_code_.empty(); }
+  inline bool hasMemoryHooks() const { return !hooks_memory_.empty(); }
+  inline bool hasAllEventsHooks() const { return !hooks_all_events_.empty(); }
+  inline bool hasBlockHooks() const { return !hooks_block_.empty(); }
+  inline bool hasInterruptHooks() const { return !hooks_interrupt_.empty(); }
+
+  inline std::list<HookCode *> &getCodeRangeHooks() { return hooks_code_range_; }
+  inline std::list<HookMemory *> &getMemoryRangeHooks() { return hooks_memory_range_; }
+
   void run(address_t address, HookCode::hook_arg_t *arg) {
     hooks_code_.run(address, arg);
   }
@@ -69,6 +107,23 @@ class HookManager {
     hooks_all_events_.run(address, arg);
   }
 
+  void run(address_t address, HookBlock::hook_arg_t *arg) {
+    hooks_block_.run(address, arg);
+  }
+
+  void run(address_t address, HookInterrupt::hook_arg_t *arg) {
+    hooks_interrupt_.run(address, arg);
+  }
+
+  // Run a single (range) hook
+  void run(HookCode *hook, address_t address, HookCode::hook_arg_t *arg) {
+    Hooks<HookCode>::runHook(hook, address, arg);
+  }
+
+  void run(HookMemory *hook, address_t address, HookMemory::hook_arg_t *arg) {
+    Hooks<HookMemory>::runHook(hook, address, arg);
+  }
+
   Hook *get(std::string name) {
     for (Hook *h : hooks_all) {
       if (h->name == name) {
@@ -21,53 +21,57 @@ class Hooks {
     hooks.push_back(hook);
   }
 
-  template <typename T>
-  void run(address_t address, T *arg) {
-    // Run the hooks
-    hooklist_t::iterator it = hooks.begin();
-    while (it != hooks.end()) {
-      auto hk = ((C *)*it);
+  inline bool empty() const { return hooks.empty(); }
+  inline size_t size() const { return hooks.size(); }
 
-      // Pre hook->run() actions
-      auto hk_status = hk->getStatus();
-      switch (hk_status) {
-        case Hook::STATUS_DISABLED:
-          ++it;
-          continue;
-        //case Hook::STATUS_DELETE:
-        //  it = hooks.erase(it);
-        //  continue;
-        default:
-          break;
-      }
+  // Run a single hook, returns false if the remaining hooks should be skipped
+  template <typename T>
+  static bool runHook(C *hk, address_t address, T *arg) {
+    // Pre hook->run() actions
+    auto hk_status = hk->getStatus();
+    switch (hk_status) {
+      case Hook::STATUS_DISABLED:
+        return true;
+      //case Hook::STATUS_DELETE:
+      //  it = hooks.erase(it);
+      //  continue;
+      default:
+        break;
+    }
 
-      if (hk->getType() == Hook::TYPE_ALL) { // Always runs
+    if (hk->getType() == Hook::TYPE_ALL) { // Always runs
+      hk->run(arg);
+    } else if (hk->getType() == Hook::TYPE_RANGE) { // Run if in the range
+      if (address >= hk->low && address <= hk->high) { // Fits in range
         hk->run(arg);
-      } else if (hk->getType() == Hook::TYPE_RANGE) { // Run if in the range
-        if (address >= hk->low && address <= hk->high) { // Fits in range
-          hk->run(arg);
-        }
       }
+    }
 
-      // Post hook->run() actions
-      hk_status = hk->getStatus();
-      switch (hk_status) {
-        case Hook::STATUS_OK:
-          ++it;
-          break;
-        case Hook::STATUS_SKIP_REST:
-          it = hooks.end();
-          break;
-        case Hook::STATUS_ERROR:
-          std::cerr << "Hook error in " << hk->name << std::endl;
-          ++it;
-          break;
-        //case Hook::STATUS_DELETE_NOW:
-        //  it = hooks.erase(it);
-        //  break;
-        default:
-          std::cerr << "Missed a hook case, moving to the next hook, but check the code" << std::endl;
-          ++it;
+    // Post hook->run() actions
+    hk_status = hk->getStatus();
+    switch (hk_status) {
+      case Hook::STATUS_OK:
+        return true;
+      case Hook::STATUS_SKIP_REST:
+        return false;
+      case Hook::STATUS_ERROR:
+        std::cerr << "Hook error in " << hk->name << std::endl;
+        return true;
+      //case Hook::STATUS_DELETE_NOW:
+      //  it = hooks.erase(it);
+      //  break;
+      default:
+        std::cerr << "Missed a hook case, moving to the next hook, but check the code" << std::endl;
+        return true;
+    }
+  }
+
+  template <typename T>
+  void run(address_t address, T *arg) {
+    // Run the hooks
+    for (auto hk : hooks) {
+      if (!runHook((C *)hk, address, arg)) {
+        break;
       }
     }
   }
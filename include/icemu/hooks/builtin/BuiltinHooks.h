@@ -3,7 +3,6 @@
 
 #include "icemu/hooks/HookManager.h"
 #include "icemu/hooks/builtin/HookInstructionCount.h"
-#include "icemu/hooks/builtin/HookStopEmulation.h"
 
 namespace icemu {
 
@@ -11,7 +10,6 @@ namespace BuiltinHooks {
 
   void registerHooks(Emulator &emu, HookManager &hm) {
     hm.add(new HookInstructionCount(emu)); // Instruction count hook
-    hm.add(new HookStopEmulation(emu)); // Stop emulation hook
   }
 
 }
@@ -3,25 +3,36 @@
 
 #include <iostream>
 
-#include "icemu/hooks/HookCode.h"
+#include "icemu/emu/Emulator.h"
+#include "icemu/hooks/HookBlock.h"
 
 namespace icemu {
 
-class HookInstructionCount : public HookCode {
+/*
+ * Reports the instructions the emulator executed (see
+ * Emulator::getInstructionCount()), the blocks themselves are not counted
+ * here: a block that is cut short would count as a whole and the steps of
+ * the idle loop probe are not reported to the block hooks.
+ */
+class HookInstructionCount : public HookBlock {
  private:
   uint64_t icnt = 0;
 
  public:
-  HookInstructionCount(Emulator &emu) : HookCode(emu, "icnt") {
+  HookInstructionCount(Emulator &emu) : HookBlock(emu, "icnt") {
+    // The run ends with a flush, the hooks are deleted while the emulator
+    // is destroyed
+    emu.addFlushCallback([this]() { icnt = getEmulator().getInstructionCount(); });
   }
 
   ~HookInstructionCount() {
     std::cout << "The program ran for: " << icnt << " instructions" << std::endl;
   }
 
+  inline uint64_t getInstructionCount() { return getEmulator().getInstructionCount(); }
+
   void run(hook_arg_t *arg) {
     (void)arg;  // Don't care
-    ++icnt;
   }
 };
 }
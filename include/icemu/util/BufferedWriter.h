@@ -0,0 +1,88 @@
+#ifndef ICEMU_UTIL_BUFFERED_WRITER_H_
+#define ICEMU_UTIL_BUFFERED_WRITER_H_
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <unistd.h>
+
+namespace icemu {
+
+/*
+ * Collects the output of the emulated code and writes it to a host file
+ * descriptor in large writes, instead of one write (or stream insert) per
+ * character. Flush before anything else writes to the same file (e.g., see
+ * Emulator::addFlushCallback()).
+ */
+class BufferedWriter {
+ private:
+  int fd_;
+  std::vector<char> buffer_;
+  size_t used_ = 0;
+  bool good_ = true;
+
+  bool writeAll(const char *data, size_t size) {
+    while (size) {
+      ssize_t n = ::write(fd_, data, size);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        good_ = false;
+        return false;
+      }
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+
+ public:
+  explicit BufferedWriter(int fd = STDOUT_FILENO, size_t capacity = 64 * 1024)
+      : fd_(fd), buffer_(capacity) {}
+
+  ~BufferedWriter() { flush(); }
+
+  BufferedWriter(const BufferedWriter &) = delete;
+  BufferedWriter &operator=(const BufferedWriter &) = delete;
+
+  inline int getFd() const { return fd_; }
+  inline bool good() const { return good_; }
+
+  bool write(const void *data, size_t size) {
+    if (used_ + size > buffer_.size()) {
+      if (!flush()) {
+        return false;
+      }
+      // Does not fit at all, skip the buffer
+      if (size > buffer_.size()) {
+        return writeAll((const char *)data, size);
+      }
+    }
+    memcpy(&buffer_[used_], data, size);
+    used_ += size;
+    return true;
+  }
+
+  inline bool put(char c) { return write(&c, 1); }
+
+  bool flush() {
+    if (used_ == 0) {
+      return good_;
+    }
+
+    // Whatever went through the streams before goes first
+    std::cout.flush();
+    std::cerr.flush();
+
+    size_t size = used_;
+    used_ = 0;
+    return writeAll(buffer_.data(), size);
+  }
+};
+
+}  // namespace icemu
+
+#endif /* ICEMU_UTIL_BUFFERED_WRITER_H_ */
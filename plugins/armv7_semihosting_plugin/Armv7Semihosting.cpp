@@ -0,0 +1,390 @@
+/**
+ *  ICEmu loadable plugin (library)
+ *
+ *  ARM semihosting (bkpt 0xab) for Cortex-M code, e.g., linked with
+ *  --specs=rdimon.specs. The bkpt traps to the interrupt hook, so only the
+ *  semihosting calls cost something. The console output is buffered and
+ *  written to the host in large writes.
+ *
+ *  Supported: SYS_OPEN, SYS_CLOSE, SYS_WRITEC, SYS_WRITE0, SYS_WRITE,
+ *  SYS_READ, SYS_ISTTY, SYS_SEEK, SYS_FLEN, SYS_ERRNO, SYS_EXIT and
+ *  SYS_EXIT_EXTENDED. Files are opened relative to the working directory.
+ */
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "icemu/emu/Emulator.h"
+#include "icemu/hooks/HookInterrupt.h"
+#include "icemu/hooks/HookManager.h"
+#include "icemu/hooks/RegisterHook.h"
+#include "icemu/util/BufferedWriter.h"
+
+using namespace std;
+using namespace icemu;
+
+class Armv7Semihosting : public HookInterrupt {
+ private:
+  enum Operation : uint32_t {
+    SYS_OPEN = 0x01,
+    SYS_CLOSE = 0x02,
+    SYS_WRITEC = 0x03,
+    SYS_WRITE0 = 0x04,
+    SYS_WRITE = 0x05,
+    SYS_READ = 0x06,
+    SYS_ISTTY = 0x09,
+    SYS_SEEK = 0x0A,
+    SYS_FLEN = 0x0C,
+    SYS_ERRNO = 0x13,
+    SYS_EXIT = 0x18,
+    SYS_EXIT_EXTENDED = 0x20,
+  };
+
+  const uint32_t excp_bkpt = 7;           // Exception number in unicorn
+  const uint16_t bkpt_semihosting = 0xbeab;  // bkpt 0xab
+  const uint32_t adp_stopped_application_exit = 0x20026;
+
+  // The guest picks the length, copies go through a buffer of at most this
+  const uint32_t copy_chunk = 64 * 1024;
+
+  ArchitectureArmv7 &arch_;
+  MemoryView &mem_;
+
+  // Console, the guest gets the host descriptors as handles
+  BufferedWriter out_{STDOUT_FILENO};
+  BufferedWriter err_{STDERR_FILENO};
+
+  set<int> files_;  // Opened by the guest
+  int errno_ = 0;
+
+  string printLeader() {
+    return "[semihosting] ";
+  }
+
+  bool argument(uint32_t block, unsigned n, uint32_t &value) {
+    return mem_.load(block + 4 * n, value);
+  }
+
+  uint32_t fail() {
+    errno_ = errno;
+    return (uint32_t)-1;
+  }
+
+  bool writeHost(int fd, const void *data, size_t size) {
+    if (fd == STDOUT_FILENO) {
+      return out_.write(data, size);
+    }
+    if (fd == STDERR_FILENO) {
+      return err_.write(data, size);
+    }
+
+    const char *p = (const char *)data;
+    while (size) {
+      ssize_t n = ::write(fd, p, size);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        errno_ = errno;
+        return false;
+      }
+      p += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  // Copy the guest buffer (in one go if it is in one segment), false if it
+  // is not (all) mapped
+  bool writeGuest(int fd, uint32_t address, uint32_t len) {
+    MemorySpan s = mem_.span(address, len);
+    if (s) {
+      return writeHost(fd, s.data(), len);
+    }
+
+    vector<char> data(min(len, copy_chunk));
+    while (len) {
+      uint32_t n = min(len, copy_chunk);
+      if (!mem_.read(address, data.data(), n) || !writeHost(fd, data.data(), n)) {
+        return false;
+      }
+      address += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  // A NUL terminated string
+  bool writeString(uint32_t address) {
+    char chunk[256];
+    while (true) {
+      // Don't read into the next page, it might not be mapped
+      uint32_t len = sizeof(chunk);
+      uint32_t page_left = Memory::page_size - address % Memory::page_size;
+      if (len > page_left) {
+        len = page_left;
+      }
+      if (!mem_.read(address, chunk, len)) {
+        return false;
+      }
+
+      const char *end = (const char *)memchr(chunk, 0, len);
+      out_.write(chunk, end ? end - chunk : len);
+      if (end) {
+        return true;
+      }
+      address += len;
+    }
+  }
+
+  uint32_t sysOpen(uint32_t block) {
+    uint32_t name_address, mode, len;
+    if (!argument(block, 0, name_address) || !argument(block, 1, mode) ||
+        !argument(block, 2, len) || mode > 11) {
+      return (uint32_t)-1;
+    }
+
+    if (len > PATH_MAX) {
+      errno_ = ENAMETOOLONG;
+      return (uint32_t)-1;
+    }
+
+    string name(len, '\0');
+    if (!mem_.read(name_address, &name[0], len)) {
+      return (uint32_t)-1;
+    }
+
+    // The console, read for stdin, write for stdout and append for stderr
+    if (name == ":tt") {
+      return mode < 4 ? STDIN_FILENO : mode < 8 ? STDOUT_FILENO : STDERR_FILENO;
+    }
+
+    // The fopen() modes r, rb, r+, r+b, w, wb, w+, w+b, a, ab, a+, a+b
+    static const int flags[] = {
+        O_RDONLY, O_RDONLY, O_RDWR, O_RDWR,
+        O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_TRUNC,
+        O_RDWR | O_CREAT | O_TRUNC, O_RDWR | O_CREAT | O_TRUNC,
+        O_WRONLY | O_CREAT | O_APPEND, O_WRONLY | O_CREAT | O_APPEND,
+        O_RDWR | O_CREAT | O_APPEND, O_RDWR | O_CREAT | O_APPEND};
+    int fd = ::open(name.c_str(), flags[mode], 0644);
+    if (fd < 0) {
+      return fail();
+    }
+    files_.insert(fd);
+    return fd;
+  }
+
+  uint32_t sysClose(uint32_t block) {
+    uint32_t fd;
+    if (!argument(block, 0, fd)) {
+      return (uint32_t)-1;
+    }
+    if (fd <= STDERR_FILENO) {
+      out_.flush();
+      err_.flush();
+      return 0;
+    }
+    if (!files_.erase(fd)) {
+      errno_ = EBADF;
+      return (uint32_t)-1;
+    }
+    return ::close(fd) == 0 ? 0 : fail();
+  }
+
+  // Returns the number of bytes NOT written
+  uint32_t sysWrite(uint32_t block) {
+    uint32_t fd, buffer, len;
+    if (!argument(block, 0, fd) || !argument(block, 1, buffer) || !argument(block, 2, len)) {
+      return (uint32_t)-1;
+    }
+    if (fd > STDERR_FILENO && !files_.count(fd)) {
+      errno_ = EBADF;
+      return len;
+    }
+    return writeGuest(fd, buffer, len) ? 0 : len;
+  }
+
+  // Returns the number of bytes NOT read
+  uint32_t sysRead(uint32_t block) {
+    uint32_t fd, buffer, len;
+    if (!argument(block, 0, fd) || !argument(block, 1, buffer) || !argument(block, 2, len)) {
+      return (uint32_t)-1;
+    }
+    if (fd == STDIN_FILENO) {
+      // A prompt goes out before the program waits for the answer
+      out_.flush();
+      err_.flush();
+    } else if (!files_.count(fd)) {
+      errno_ = EBADF;
+      return len;
+    }
+
+    // Through a copy, the guest memory might be write protected to track
+    // dirty pages (which a host read() does not handle)
+    vector<char> data(min(len, copy_chunk));
+    uint32_t done = 0;
+    while (done < len) {
+      uint32_t want = min(len - done, copy_chunk);
+      ssize_t n;
+      do {
+        n = ::read(fd, data.data(), want);
+      } while (n < 0 && errno == EINTR);
+      if (n < 0) {
+        fail();
+        return len - done;
+      }
+      if (!mem_.write(buffer + done, data.data(), n)) {
+        return len - done;
+      }
+      done += n;
+
+      // The end of the file (or what a terminal has so far)
+      if ((uint32_t)n < want) {
+        break;
+      }
+    }
+    return len - done;
+  }
+
+  uint32_t sysSeek(uint32_t block) {
+    uint32_t fd, position;
+    if (!argument(block, 0, fd) || !argument(block, 1, position) || !files_.count(fd)) {
+      return (uint32_t)-1;
+    }
+    return ::lseek(fd, position, SEEK_SET) < 0 ? fail() : 0;
+  }
+
+  uint32_t sysFlen(uint32_t block) {
+    uint32_t fd;
+    struct stat st;
+    if (!argument(block, 0, fd) || !files_.count(fd)) {
+      return (uint32_t)-1;
+    }
+    return ::fstat(fd, &st) < 0 ? fail() : (uint32_t)st.st_size;
+  }
+
+  void sysExit(uint32_t reason, uint32_t status) {
+    out_.flush();
+    err_.flush();
+    if (reason != adp_stopped_application_exit) {
+      cerr << printLeader() << "exit with reason 0x" << hex << reason << dec << endl;
+      status = 1;
+    }
+
+    // Shows up as the result register
+    arch_.registerSet(ArchitectureArmv7::REG_R0, status);
+    getEmulator().stop("semihosting exit (status " + to_string(status) + ")");
+  }
+
+ public:
+  Armv7Semihosting(Emulator &emu)
+      : HookInterrupt(emu, "semihosting"),
+        arch_(emu.getArchitecture().getArmv7Architecture()),
+        mem_(emu.getMemoryView()) {
+    emu.addFlushCallback([this]() {
+      out_.flush();
+      err_.flush();
+    });
+  }
+
+  ~Armv7Semihosting() {
+    for (auto fd : files_) {
+      ::close(fd);
+    }
+  }
+
+  // Hook run
+  void run(hook_arg_t *arg) {
+    address_t pc = arg->address & ~1;
+    uint16_t instruction = 0;
+    if (arg->intno != excp_bkpt || !mem_.load(pc, instruction) ||
+        instruction != bkpt_semihosting) {
+      return;
+    }
+
+    uint32_t operation = arch_.registerGet(ArchitectureArmv7::REG_R0);
+    uint32_t parameter = arch_.registerGet(ArchitectureArmv7::REG_R1);
+    uint32_t result = 0;
+    uint32_t reason, status;
+    uint8_t c;
+
+    switch (operation) {
+      case SYS_OPEN:
+        result = sysOpen(parameter);
+        break;
+      case SYS_CLOSE:
+        result = sysClose(parameter);
+        break;
+      case SYS_WRITEC:
+        if (mem_.load(parameter, c)) {
+          out_.put((char)c);
+        }
+        break;
+      case SYS_WRITE0:
+        writeString(parameter);
+        break;
+      case SYS_WRITE:
+        result = sysWrite(parameter);
+        break;
+      case SYS_READ:
+        result = sysRead(parameter);
+        break;
+      case SYS_ISTTY:
+        result = argument(parameter, 0, status) && status <= STDERR_FILENO;
+        break;
+      case SYS_SEEK:
+        result = sysSeek(parameter);
+        break;
+      case SYS_FLEN:
+        result = sysFlen(parameter);
+        break;
+      case SYS_ERRNO:
+        result = errno_;
+        break;
+      case SYS_EXIT:
+        // The reason is passed directly (AArch32)
+        sysExit(parameter, 0);
+        break;
+      case SYS_EXIT_EXTENDED:
+        if (argument(parameter, 0, reason) && argument(parameter, 1, status)) {
+          sysExit(reason, status);
+        }
+        break;
+      default:
+        cerr << printLeader() << "unsupported operation 0x" << hex << operation
+             << " at 0x" << pc << dec << endl;
+        result = (uint32_t)-1;
+        break;
+    }
+
+    if (operation != SYS_EXIT && operation != SYS_EXIT_EXTENDED) {
+      arch_.registerSet(ArchitectureArmv7::REG_R0, result);
+    }
+
+    // Continue after the bkpt
+    arch_.registerSet(ArchitectureArmv7::REG_PC, (pc + 2) | 1);
+    arg->handled = true;
+  }
+};
+
+// Function that registers the hook
+static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
+  if (emu.getArch() != EMU_ARCH_ARMV7) {
+    cerr << "[semihosting] ARM semihosting is only supported for ARMv7" << endl;
+    return;
+  }
+
+  HM.add(new Armv7Semihosting(emu));
+}
+
+// Class that is used by ICEmu to finf the register function
+// NB.  * MUST BE NAMED "RegisterMyHook"
+//      * MUST BE global
+RegisterHook RegisterMyHook(registerMyCodeHook);
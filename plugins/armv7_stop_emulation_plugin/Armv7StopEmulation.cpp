@@ -6,41 +6,20 @@
 #include <iostream>
 
 #include "icemu/emu/Emulator.h"
-#include "icemu/hooks/HookCode.h"
 #include "icemu/hooks/HookManager.h"
 #include "icemu/hooks/RegisterHook.h"
 
 using namespace std;
 using namespace icemu;
 
-class Armv7StopEmulation : public HookCode {
- private:
-  // Stop emulation when we reach a breakpoint instruction
-  const uint16_t breakpoint_instr = 0xbe00; 
-
- public:
-  Armv7StopEmulation(Emulator &emu) : HookCode(emu, "armv7_stop_emulation") {
-  }
-
-  // Hook run
-  void run(hook_arg_t *arg) {
-    uint16_t instr;
-    if (getEmulator().readMemory(arg->address, (char *)&instr, sizeof(instr))) {
-      if (instr == breakpoint_instr) {
-        getEmulator().stop("Breakpoint instruction");
-        setStatus(Hook::STATUS_SKIP_REST);
-      }
-    } else {
-      std::cerr << "Could not read instruction memory" << std::endl;
-      getEmulator().stop("Could not read instruction");
-      setStatus(Hook::STATUS_SKIP_REST);
-    }
-  }
-};
-
-// Function that registers the hook
+// Stop emulation when we reach a breakpoint instruction (bkpt #0), the
+// breakpoints are found when loading and registered as unicorn exit points
+// so nothing is checked per executed instruction
 static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
-  HM.add(new Armv7StopEmulation(emu));
+  (void)HM;
+  size_t found = emu.addBreakpointExitPoints();
+  std::cout << "[armv7-stop-emulation] found " << found
+            << " breakpoint instruction(s)" << std::endl;
 }
 
 // Class that is used by ICEmu to finf the register function
@@ -0,0 +1,242 @@
+/**
+ *  ICEmu loadable plugin (library)
+ *
+ *  The SysTick timer of the Cortex-M. The current value and COUNTFLAG are
+ *  computed from the emulated time (see Emulator::getTime()) when they are
+ *  read, and the SysTick exception is an event at the time the counter
+ *  reaches zero. So the timer costs nothing per instruction.
+ *
+ *  NB. In an access to the device the emulated time counts the block that
+ *  accesses it as a whole. The exceptions happen at the exact time.
+ *
+ *  arguments:
+ *    systick-divider=<instructions per tick> (default 1)
+ */
+#include <iostream>
+#include <string>
+
+#include "icemu/emu/Emulator.h"
+#include "icemu/emu/EventQueue.h"
+#include "icemu/emu/MmioDevice.h"
+#include "icemu/hooks/HookManager.h"
+#include "icemu/hooks/RegisterHook.h"
+
+#include "PluginArgumentParsing.h"
+
+using namespace std;
+using namespace icemu;
+
+class Armv7Systick : public MmioDevice {
+ private:
+  const address_t csr_address = 0xE000E010;
+  const address_t rvr_address = 0xE000E014;
+  const address_t cvr_address = 0xE000E018;
+  const address_t calib_address = 0xE000E01C;
+
+  const uint32_t csr_enable = 1 << 0;
+  const uint32_t csr_tickint = 1 << 1;
+  const uint32_t csr_clksource = 1 << 2;
+  const uint32_t csr_countflag = 1 << 16;
+  const uint32_t counter_mask = 0xFFFFFF;
+  // No reference clock and no exact 10ms calibration value
+  const uint32_t calib_value = 0xC0000000;
+
+  const unsigned exception_systick = 15;
+
+  uint64_t divider = 1;
+
+  uint32_t csr = 0;  // Without COUNTFLAG
+  uint32_t rvr = 0;
+
+  // The counter had start_value at start_time, it counts down from there
+  // while enabled
+  uint32_t start_value = 0;
+  uint64_t start_time = 0;
+
+  // COUNTFLAG is set when the counter reached zero since it was last read
+  bool countflag = false;
+  uint64_t zeros_read = 0;  // Zeros since start_time when CSR was read
+
+  EventQueue::event_id_t event = 0;
+
+  string printLeader() {
+    return "[systick] ";
+  }
+
+  inline bool enabled() {
+    return csr & csr_enable;
+  }
+
+  // Ticks since start_time
+  uint64_t elapsed() {
+    return enabled() ? (getEmulator().getTime() - start_time) / divider : 0;
+  }
+
+  // Tick at which the counter reaches zero the first time after start_time,
+  // the counter then reloads and reaches zero every rvr + 1 ticks. Zero if
+  // it never does.
+  uint64_t firstZero() {
+    if (start_value) {
+      return start_value;
+    }
+    return rvr ? (uint64_t)rvr + 1 : 0;
+  }
+
+  // Number of times the counter reached zero in the first ticks
+  uint64_t zeros(uint64_t ticks) {
+    uint64_t first = firstZero();
+    if (first == 0 || ticks < first) {
+      return 0;
+    }
+    // A reload value of zero stops the counter at the next wrap
+    return rvr ? 1 + (ticks - first) / ((uint64_t)rvr + 1) : 1;
+  }
+
+  uint32_t value(uint64_t ticks) {
+    uint64_t first = firstZero();
+    if (ticks == 0 || first == 0) {
+      return start_value;
+    }
+    if (ticks < first) {
+      return first - ticks;
+    }
+    if (rvr == 0) {
+      return 0;
+    }
+    uint64_t period = (uint64_t)rvr + 1;
+    return (period - (ticks - first) % period) % period;
+  }
+
+  // Start counting again from the current value, before the configuration
+  // changes
+  void rebase() {
+    uint64_t ticks = elapsed();
+    countflag |= zeros(ticks) > zeros_read;
+    zeros_read = 0;
+    start_value = value(ticks);
+    start_time = enabled() ? start_time + ticks * divider : getEmulator().getTime();
+  }
+
+  // Pend the exception when the counter reaches zero (next)
+  void schedule() {
+    EventQueue &events = getEmulator().getEventQueue();
+    events.cancel(event);
+    if (!enabled() || !(csr & csr_tickint)) {
+      return;
+    }
+
+    uint64_t n = zeros(elapsed());
+    uint64_t first = firstZero();
+    if (first == 0 || (rvr == 0 && n > 0)) {
+      return;
+    }
+
+    uint64_t tick = first + n * ((uint64_t)rvr + 1);
+    event = events.schedule(start_time + tick * divider, "systick", [this]() {
+      getEmulator().raiseInterrupt(0, exception_systick);
+      schedule();
+    });
+  }
+
+ public:
+  bool good = true;
+
+  Armv7Systick(Emulator &emu) : MmioDevice(emu, "systick", 0xE000E010, 0x10) {
+    auto divider_arg = PluginArgumentParsing::GetArguments(emu, "systick-divider=");
+    if (divider_arg.size()) {
+      divider = stoull(divider_arg[0], nullptr, 0);
+    }
+    if (divider == 0) {
+      cerr << printLeader() << "the divider must be at least one instruction per tick" << endl;
+      good = false;
+      return;
+    }
+
+    start_time = emu.getTime();
+    cout << printLeader() << "ticks every " << divider << " instructions" << endl;
+  }
+
+  ~Armv7Systick() {
+  }
+
+  // The rest of the window are the other system control registers
+  uint64_t read(address_t address, unsigned access_size) {
+    if (address == csr_address) {
+      uint64_t ticks = elapsed();
+      uint64_t z = zeros(ticks);
+      bool flag = countflag || z > zeros_read;
+
+      // Reading clears COUNTFLAG
+      countflag = false;
+      zeros_read = z;
+      return csr | (flag ? csr_countflag : 0);
+    }
+    if (address == rvr_address) {
+      return rvr;
+    }
+    if (address == cvr_address) {
+      return value(elapsed());
+    }
+    if (address == calib_address) {
+      return calib_value;
+    }
+    return readBacking(address, access_size);
+  }
+
+  // The current value and COUNTFLAG change while the counter runs
+  bool readDependsOnTime(address_t address) {
+    return enabled() && (address == cvr_address || address == csr_address);
+  }
+
+  void write(address_t address, unsigned access_size, uint64_t value) {
+    if (address == csr_address) {
+      rebase();
+      csr = value & (csr_enable | csr_tickint | csr_clksource);
+      schedule();
+    } else if (address == rvr_address) {
+      rebase();
+      rvr = value & counter_mask;
+      schedule();
+    } else if (address == cvr_address) {
+      // Any write clears the counter and COUNTFLAG
+      rebase();
+      start_value = 0;
+      countflag = false;
+      schedule();
+    } else if (address != calib_address) {
+      writeBacking(address, access_size, value);
+    }
+  }
+
+  void reset() {
+    getEmulator().getEventQueue().cancel(event);
+    csr = 0;
+    rvr = 0;
+    start_value = 0;
+    start_time = getEmulator().getTime();
+    countflag = false;
+    zeros_read = 0;
+  }
+};
+
+// Function that registers the hook
+static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
+  (void)HM;
+
+  if (emu.getArch() != EMU_ARCH_ARMV7) {
+    cerr << "[systick] SysTick is only supported for ARMv7" << endl;
+    return;
+  }
+
+  auto p = new Armv7Systick(emu);
+  if (p->good) {
+    emu.addMmioDevice(p);
+  } else {
+    delete p;
+  }
+}
+
+// Class that is used by ICEmu to finf the register function
+// NB.  * MUST BE NAMED "RegisterMyHook"
+//      * MUST BE global
+RegisterHook RegisterMyHook(registerMyCodeHook);
@@ -156,8 +156,8 @@ class RiscvE21Pipeline {
           assert(false && "CycleCount: Unknown register mapping, fixme");
           break;
       }
-      // Return the register value
-      return getEmulator().getArchitecture().getRiscv32Architecture().registerGet(reg);
+      // Return the register value, shared with the other hooks of this event
+      return getEmulator().getArchitecture().getRegisterCache().get(reg);
     }
 
     address_t divisionLatency(int32_t dividend, int32_t divisor) {
@@ -692,16 +692,14 @@ class RiscvE21Pipeline {
       verifyJump(address);
 
       // Process the instruction
-      uint8_t instruction[size];
-
-      bool ok = getEmulator().readMemory(address, (char *)instruction, size);
-      if (!ok) {
+      MemorySpan instruction = getEmulator().getMemoryView().span(address, size);
+      if (!instruction) {
         std::cerr << "CycleCounter: failed to read memory for instruction at address " << address << std::endl;
         assert(false);
       }
 
       cs_insn *insn = NULL;
-      size_t cnt = cs_disasm(*getEmulator().getCapstoneEngine(), instruction, size, address, 1, &insn);
+      size_t cnt = cs_disasm(*getEmulator().getCapstoneEngine(), instruction.data(), size, address, 1, &insn);
       if (cnt == 0) {
         std::cerr << "CycleCounter: failed to disassemble instruction at address " << address << std::endl;
         assert(false);
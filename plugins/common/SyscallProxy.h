@@ -0,0 +1,388 @@
+#pragma once
+/**
+ *  The newlib/pk system call ABI (the RISC-V Linux numbers) served from the
+ *  host: write, read, openat/open, close, lseek, fstat, exit and brk. Used
+ *  by the plugins that catch the system calls of the emulated code (e.g., an
+ *  ecall or a tohost write).
+ *
+ *  The console output is buffered and written to the host in large writes,
+ *  file descriptors other than the console are host descriptors. The flags
+ *  of open are passed on as is (Linux values, like pk does). For ARM EABI
+ *  code (arm) fstat fills in the ARM struct stat.
+ *
+ *  arguments:
+ *    <prefix>-logfile=<file_to_copy_the_console_output_to>
+ */
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "icemu/emu/Emulator.h"
+#include "icemu/util/BufferedWriter.h"
+
+#include "PluginArgumentParsing.h"
+
+/*
+ * T is the register width of the guest (uint32_t or uint64_t)
+ */
+template <class T>
+class SyscallProxy {
+ public:
+  typedef T reg_t;
+  typedef typename std::make_signed<T>::type sreg_t;
+
+  enum Syscall : T {
+    SYS_openat = 56,
+    SYS_close = 57,
+    SYS_lseek = 62,
+    SYS_read = 63,
+    SYS_write = 64,
+    SYS_fstat = 80,
+    SYS_exit = 93,
+    SYS_exit_group = 94,
+    SYS_brk = 214,
+    SYS_open = 1024,
+  };
+
+  static const unsigned max_args = 6;
+
+ private:
+  // The guest picks the length, copies go through a buffer of at most this
+  const T copy_chunk = 64 * 1024;
+
+  icemu::Emulator &emu_;
+  icemu::MemoryView &mem_;
+  std::string leader_;
+  bool arm_;
+
+  // Console
+  icemu::BufferedWriter out_{STDOUT_FILENO};
+  icemu::BufferedWriter err_{STDERR_FILENO};
+  int log_fd_ = -1;
+  std::unique_ptr<icemu::BufferedWriter> log_;
+
+  std::set<int> files_;  // Opened by the guest
+
+  // The break, where it starts and the lowest stack pointer seen (the heap
+  // stays below the stack)
+  T brk_ = 0;
+  T brk_start_ = 0;
+  T lowest_sp_ = ~(T)0;
+
+  bool exited_ = false;
+  T exit_code_ = 0;
+
+  std::set<T> reported_;  // Unsupported system calls that were reported
+
+  static T error(int err) { return (T)(-(sreg_t)err); }
+
+  bool writeHost(int fd, const void *data, size_t size) {
+    if (fd == STDOUT_FILENO || fd == STDERR_FILENO) {
+      if (log_) {
+        log_->write(data, size);
+      }
+      return (fd == STDOUT_FILENO ? out_ : err_).write(data, size);
+    }
+
+    const char *p = (const char *)data;
+    while (size) {
+      ssize_t n = ::write(fd, p, size);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      p += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  bool isFile(T fd) { return files_.count((int)fd) != 0; }
+
+  T sysWrite(T fd, T buffer, T len) {
+    if (fd > STDERR_FILENO && !isFile(fd)) {
+      return error(EBADF);
+    }
+
+    // The buffer in one go, without a copy if it is in one segment
+    icemu::MemorySpan s = mem_.span(buffer, len);
+    if (s) {
+      return writeHost((int)fd, s.data(), len) ? len : error(errno);
+    }
+    std::vector<char> data(std::min(len, copy_chunk));
+    for (T done = 0; done < len;) {
+      T n = std::min(len - done, copy_chunk);
+      if (!mem_.read(buffer + done, data.data(), n)) {
+        return done ? done : error(EFAULT);
+      }
+      if (!writeHost((int)fd, data.data(), n)) {
+        return done ? done : error(errno);
+      }
+      done += n;
+    }
+    return len;
+  }
+
+  T sysRead(T fd, T buffer, T len) {
+    if (fd == STDIN_FILENO) {
+      // A prompt goes out before the program waits for the answer
+      flush();
+    } else if (!isFile(fd)) {
+      return error(EBADF);
+    }
+
+    // Through a copy, the guest memory might be write protected to track
+    // dirty pages (which a host read() does not handle)
+    std::vector<char> data(std::min(len, copy_chunk));
+    T done = 0;
+    while (done < len) {
+      T want = std::min(len - done, copy_chunk);
+      ssize_t n;
+      do {
+        n = ::read((int)fd, data.data(), want);
+      } while (n < 0 && errno == EINTR);
+      if (n < 0) {
+        return done ? done : error(errno);
+      }
+      if (!mem_.write(buffer + done, data.data(), n)) {
+        return done ? done : error(EFAULT);
+      }
+      done += n;
+
+      // The end of the file (or what a terminal has so far)
+      if ((T)n < want) {
+        break;
+      }
+    }
+    return done;
+  }
+
+  T sysOpenat(T dirfd, T path, T flags, T mode) {
+    // The path, read up to the NUL (or a maximum length)
+    std::string name;
+    char c = 1;
+    while (mem_.load(path + name.size(), c) && c != '\0') {
+      name.push_back(c);
+      if (name.size() > PATH_MAX) {
+        return error(ENAMETOOLONG);
+      }
+    }
+    if (c != '\0') {
+      return error(EFAULT);
+    }
+
+    int host_dirfd = (sreg_t)dirfd == AT_FDCWD ? AT_FDCWD : (int)dirfd;
+    if (host_dirfd != AT_FDCWD && !isFile(dirfd)) {
+      return error(EBADF);
+    }
+
+    int fd = ::openat(host_dirfd, name.c_str(), (int)flags, (mode_t)mode);
+    if (fd < 0) {
+      return error(errno);
+    }
+    files_.insert(fd);
+    return fd;
+  }
+
+  T sysClose(T fd) {
+    if (fd <= STDERR_FILENO) {
+      flush();
+      return 0;
+    }
+    if (!files_.erase((int)fd)) {
+      return error(EBADF);
+    }
+    return ::close((int)fd) == 0 ? 0 : error(errno);
+  }
+
+  T sysLseek(T fd, T offset, T whence) {
+    if (!isFile(fd)) {
+      return fd <= STDERR_FILENO ? error(ESPIPE) : error(EBADF);
+    }
+    off_t position = ::lseek((int)fd, (off_t)(sreg_t)offset, (int)whence);
+    return position < 0 ? error(errno) : (T)position;
+  }
+
+  // Only the type and size of the (pk/kernel) stat struct are filled in,
+  // the ARM one has a 32-bit size
+  T sysFstat(T fd, T buffer) {
+    const T mode_offset = arm_ ? 8 : 16;
+    const T size_offset = arm_ ? 20 : 48;
+    const T size_size = arm_ ? 4 : 8;
+    const T clear_size = 64;
+
+    uint32_t st_mode;
+    int64_t st_size = 0;
+    if (fd <= STDERR_FILENO) {
+      st_mode = S_IFCHR | 0620;
+    } else if (isFile(fd)) {
+      struct stat st;
+      if (::fstat((int)fd, &st) < 0) {
+        return error(errno);
+      }
+      st_mode = st.st_mode;
+      st_size = st.st_size;
+    } else {
+      return error(EBADF);
+    }
+
+    char zero[clear_size] = {0};
+    if (!mem_.write(buffer, zero, clear_size) ||
+        !mem_.write(buffer + mode_offset, &st_mode, sizeof(st_mode)) ||
+        !mem_.write(buffer + size_offset, &st_size, size_size)) {
+      return error(EFAULT);
+    }
+    return 0;
+  }
+
+  // The break can move within the memory segment it starts in, but not
+  // into the stack when that is in the same segment
+  T sysBrk(T address) {
+    T sp = (T)emu_.getArchitecture().registerGet(icemu::Architecture::REG_SP);
+    lowest_sp_ = std::min(lowest_sp_, sp);
+
+    if (address == 0 || brk_ == 0) {
+      return brk_;
+    }
+
+    icemu::memseg_t *heap = emu_.getMemory().find(brk_start_ - 1);
+    if (heap == nullptr) {
+      return brk_;
+    }
+    T limit = heap->origin + heap->length;
+    if (lowest_sp_ >= brk_start_ && lowest_sp_ < limit) {
+      limit = lowest_sp_;
+    }
+    if (address >= brk_start_ && address <= limit) {
+      brk_ = address;
+    }
+    return brk_;
+  }
+
+ public:
+  SyscallProxy(icemu::Emulator &emu, std::string leader, std::string arg_prefix,
+               bool arm = false)
+      : emu_(emu), mem_(emu.getMemoryView()), leader_(leader), arm_(arm) {
+    // Copy the console output to a log file (if any)
+    auto name_arg = PluginArgumentParsing::GetArguments(emu, arg_prefix + "-logfile=");
+    if (name_arg.size()) {
+      log_fd_ = ::open(name_arg[0].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (log_fd_ < 0) {
+        std::cerr << leader_ << "failed to open: " << name_arg[0] << std::endl;
+      } else {
+        log_.reset(new icemu::BufferedWriter(log_fd_));
+        std::cout << leader_ << "writing output to: " << name_arg[0] << std::endl;
+      }
+    }
+
+    // The heap starts after the program
+    icemu::Symbols &sym = emu.getMemory().getSymbols();
+    const icemu::symbol_t *end = sym.get("_end");
+    if (end == nullptr) {
+      end = sym.get("end");
+    }
+    if (end != nullptr) {
+      brk_start_ = (end->address + 15) & ~(T)15;
+      brk_ = brk_start_;
+    }
+
+    emu.addFlushCallback([this]() { flush(); });
+    // The program starts over with an empty heap
+    emu.addResetCallback([this]() {
+      brk_ = brk_start_;
+      lowest_sp_ = ~(T)0;
+    });
+  }
+
+  ~SyscallProxy() {
+    flush();
+    log_.reset();
+    if (log_fd_ >= 0) {
+      ::close(log_fd_);
+    }
+    for (auto fd : files_) {
+      ::close(fd);
+    }
+  }
+
+  // Run system call which, returns the value for the guest (-errno when it
+  // fails, like the kernel)
+  T call(T which, const T *args) {
+    switch (which) {
+      case SYS_write:
+        return sysWrite(args[0], args[1], args[2]);
+      case SYS_read:
+        return sysRead(args[0], args[1], args[2]);
+      case SYS_openat:
+        return sysOpenat(args[0], args[1], args[2], args[3]);
+      case SYS_open:
+        return sysOpenat((T)(sreg_t)AT_FDCWD, args[0], args[1], args[2]);
+      case SYS_close:
+        return sysClose(args[0]);
+      case SYS_lseek:
+        return sysLseek(args[0], args[1], args[2]);
+      case SYS_fstat:
+        return sysFstat(args[0], args[1]);
+      case SYS_brk:
+        return sysBrk(args[0]);
+      case SYS_exit:
+      case SYS_exit_group:
+        exitProgram(args[0]);
+        return 0;
+      default:
+        if (reported_.insert(which).second) {
+          flush();
+          std::cerr << leader_ << "unsupported system call " << (uint64_t)which
+                    << std::endl;
+        }
+        return error(ENOSYS);
+    }
+  }
+
+  // The program exits, the emulator stops
+  void exitProgram(T code) {
+    exited_ = true;
+    exit_code_ = code;
+    emu_.stop("exit (status " + std::to_string((int64_t)(sreg_t)code) + ")");
+  }
+
+  // A single character on the console (e.g., the HTIF console)
+  void putChar(char c) {
+    writeHost(STDOUT_FILENO, &c, 1);
+  }
+
+  // -1 at the end of the input
+  int getChar() {
+    flush();
+    unsigned char c;
+    ssize_t n;
+    do {
+      n = ::read(STDIN_FILENO, &c, 1);
+    } while (n < 0 && errno == EINTR);
+    return n == 1 ? c : -1;
+  }
+
+  void flush() {
+    out_.flush();
+    err_.flush();
+    if (log_) {
+      log_->flush();
+    }
+  }
+
+  inline bool exited() { return exited_; }
+  inline T getExitCode() { return exit_code_; }
+};
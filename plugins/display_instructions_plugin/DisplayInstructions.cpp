@@ -43,16 +43,13 @@ class DisplayInstructions : public HookCode {
   }
 
   void displayInstruction(address_t address, address_t size) {
-    bool ok;
-    uint8_t instruction[size];
-
-    ok = getEmulator().readMemory(address, (char *)instruction, size);
-    if (!ok) {
+    MemorySpan instruction = getEmulator().getMemoryView().span(address, size);
+    if (!instruction) {
       cerr << printLeader() << " failed to read memory for instruction at address 0x" << hex << address << dec << endl;
       return;
     }
     cs_insn *insn;
-    size_t cnt = cs_disasm(*getEmulator().getCapstoneEngine(), instruction, size, address, 0, &insn);
+    size_t cnt = cs_disasm(*getEmulator().getCapstoneEngine(), instruction.data(), size, address, 0, &insn);
     if (cnt == 0) {
       cerr << printLeader() << " failed to disasemble instruction at address 0x" << hex << address << dec << endl;
       return;
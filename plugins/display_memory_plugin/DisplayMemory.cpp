@@ -6,6 +6,8 @@
  *
  * Should be compiled as a shared library, i.e. using `-shared -fPIC`
  */
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 
 #include "capstone/capstone.h"
@@ -35,9 +37,11 @@ class DisplayMemory : public HookMemory {
 
   // Hook run
   void run(hook_arg_t *arg) {
-    char *m = getEmulator().getMemory().at(arg->address&0xFFFFFFFF);
+    char *m = getEmulator().getMemory().at(arg->address&0xFFFFFFFF, arg->size);
     uint64_t value = 0;
-    memcpy(&value, m, arg->size);
+    if (m != nullptr) {
+      memcpy(&value, m, min((size_t)arg->size, sizeof(value)));
+    }
 
     switch(arg->mem_type) {
       case MEM_READ:
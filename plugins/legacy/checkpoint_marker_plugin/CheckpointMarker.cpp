@@ -104,17 +104,15 @@ class CheckpointMarker : public HookCode {
   }
 
   armaddr_t getBrachAddress(armaddr_t address, armaddr_t size) {
-    bool ok;
-    uint8_t instruction[size];
     armaddr_t branch_addr = 0;
 
-    ok = getEmulator().readMemory(address, (char *)instruction, size);
-    if (!ok) {
+    MemorySpan instruction = getEmulator().getMemoryView().span(address, size);
+    if (!instruction) {
       cerr << printLeader() << " failed to read memory for instruction at address " << address << endl;
       return 0;
     }
     cs_insn *insn;
-    size_t cnt = cs_disasm(*getEmulator().getCapstoneEngine(), instruction, size, address, 0, &insn);
+    size_t cnt = cs_disasm(*getEmulator().getCapstoneEngine(), instruction.data(), size, address, 0, &insn);
     if (cnt == 0) {
       cerr << printLeader() << " failed to disasemble instruction at address " << address << endl;
       return 0;
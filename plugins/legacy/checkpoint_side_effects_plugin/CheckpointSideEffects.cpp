@@ -5,12 +5,13 @@
 #include <regex>
 #include <cstdlib>
 #include <atomic>
+#include <sstream>
+#include <vector>
 
 #include "icemu/emu/Emulator.h"
 #include "icemu/hooks/HookFunction.h"
 #include "icemu/hooks/HookManager.h"
 #include "icemu/hooks/RegisterHook.h"
-#include "icemu/emu/Function.h"
 
 
 using namespace std;
@@ -22,14 +23,29 @@ class CheckpointMarker : public HookCode {
   const symbol_t *checkpoint_function = nullptr;
   const symbol_t *restore_function = nullptr;
 
-  armaddr_t post_checkpoint_address = 0;
+  address_t post_checkpoint_address = 0;
   bool found_restore = false;
 
   std::string printLeader() {
     return "[checkpoint-side-effects]";
   }
 
-  map<Registers::reg, armaddr_t> RegisterValueMap;
+  // The registers that must be the same after the checkpoint (all but the
+  // PC), read with one batched call
+  const vector<ArchitectureArmv7::Register> CheckedRegisters = {
+      ArchitectureArmv7::REG_R0,  ArchitectureArmv7::REG_R1,
+      ArchitectureArmv7::REG_R2,  ArchitectureArmv7::REG_R3,
+      ArchitectureArmv7::REG_R4,  ArchitectureArmv7::REG_R5,
+      ArchitectureArmv7::REG_R6,  ArchitectureArmv7::REG_R7,
+      ArchitectureArmv7::REG_R8,  ArchitectureArmv7::REG_R9,
+      ArchitectureArmv7::REG_R10, ArchitectureArmv7::REG_R11,
+      ArchitectureArmv7::REG_R12, ArchitectureArmv7::REG_R13,
+      ArchitectureArmv7::REG_R14, ArchitectureArmv7::REG_APSR};
+  const vector<string> CheckedRegisterNames = {
+      "r0", "r1", "r2",  "r3",  "r4",  "r5",      "r6",      "r7",
+      "r8", "r9", "r10", "r11", "r12", "r13(sp)", "r14(lr)", "apsr"};
+
+  vector<ArchitectureArmv7::armv7_addr_t> SavedRegisters;
   std::ostringstream RegBeforeStream;
   std::ostringstream RegRestoreStream;
 
@@ -59,17 +75,17 @@ class CheckpointMarker : public HookCode {
     findCheckpointFunction();
   }
 
-  armaddr_t getCallAddr(armaddr_t address) const {
+  address_t getCallAddr(address_t address) const {
     return (address & ~0x1) - 4;
   }
 
   ~CheckpointMarker() {
   }
 
-  armaddr_t getBrachAddress(armaddr_t address, armaddr_t size) {
+  address_t getBrachAddress(address_t address, address_t size) {
     bool ok;
     uint8_t instruction[size];
-    armaddr_t branch_addr = 0;
+    address_t branch_addr = 0;
 
     ok = getEmulator().readMemory(address, (char *)instruction, size);
     if (!ok) {
@@ -95,48 +111,29 @@ class CheckpointMarker : public HookCode {
     return branch_addr;
   }
 
-  void saveRegisters(Registers &Reg) {
-    RegisterValueMap[Registers::R0]   = Reg.get(Registers::R0);
-    RegisterValueMap[Registers::R1]   = Reg.get(Registers::R1);
-    RegisterValueMap[Registers::R2]   = Reg.get(Registers::R2);
-    RegisterValueMap[Registers::R3]   = Reg.get(Registers::R3);
-    RegisterValueMap[Registers::R4]   = Reg.get(Registers::R4);
-    RegisterValueMap[Registers::R5]   = Reg.get(Registers::R5);
-    RegisterValueMap[Registers::R6]   = Reg.get(Registers::R6);
-    RegisterValueMap[Registers::R7]   = Reg.get(Registers::R7);
-    RegisterValueMap[Registers::R8]   = Reg.get(Registers::R8);
-    RegisterValueMap[Registers::R9]   = Reg.get(Registers::R9);
-    RegisterValueMap[Registers::R10]  = Reg.get(Registers::R10);
-    RegisterValueMap[Registers::R11]  = Reg.get(Registers::R11);
-    RegisterValueMap[Registers::R12]  = Reg.get(Registers::R12);
-    RegisterValueMap[Registers::R13]  = Reg.get(Registers::R13);
-    RegisterValueMap[Registers::R14]  = Reg.get(Registers::R14);
-    RegisterValueMap[Registers::R15]  = Reg.get(Registers::R15);
-    RegisterValueMap[Registers::APSR] = Reg.get(Registers::APSR);
+  ArchitectureArmv7 &getArmv7() {
+    return getEmulator().getArchitecture().getArmv7Architecture();
   }
 
-  bool compareRegisters(Registers &Reg) {
-    if (
-    (RegisterValueMap[Registers::R0]   == Reg.get(Registers::R0)) &&
-    (RegisterValueMap[Registers::R1]   == Reg.get(Registers::R1)) &&
-    (RegisterValueMap[Registers::R2]   == Reg.get(Registers::R2)) &&
-    (RegisterValueMap[Registers::R3]   == Reg.get(Registers::R3)) &&
-    (RegisterValueMap[Registers::R4]   == Reg.get(Registers::R4)) &&
-    (RegisterValueMap[Registers::R5]   == Reg.get(Registers::R5)) &&
-    (RegisterValueMap[Registers::R6]   == Reg.get(Registers::R6)) &&
-    (RegisterValueMap[Registers::R7]   == Reg.get(Registers::R7)) &&
-    (RegisterValueMap[Registers::R8]   == Reg.get(Registers::R8)) &&
-    (RegisterValueMap[Registers::R9]   == Reg.get(Registers::R9)) &&
-    (RegisterValueMap[Registers::R10]  == Reg.get(Registers::R10)) &&
-    (RegisterValueMap[Registers::R11]  == Reg.get(Registers::R11)) &&
-    (RegisterValueMap[Registers::R12]  == Reg.get(Registers::R12)) &&
-    (RegisterValueMap[Registers::R13]  == Reg.get(Registers::R13)) &&
-    (RegisterValueMap[Registers::R14]  == Reg.get(Registers::R14)) &&
-    (RegisterValueMap[Registers::APSR] == Reg.get(Registers::APSR))
-    ){
-      return true;
+  vector<ArchitectureArmv7::armv7_addr_t> readRegisters() {
+    vector<ArchitectureArmv7::armv7_addr_t> values(CheckedRegisters.size());
+    getArmv7().registerGet(CheckedRegisters.data(), values.data(), (int)values.size());
+    return values;
+  }
+
+  void dumpRegisters(ostream &out, const vector<ArchitectureArmv7::armv7_addr_t> &values) {
+    for (size_t i = 0; i < values.size(); i++) {
+      out << CheckedRegisterNames[i] << ": 0x" << hex << values[i] << dec << endl;
     }
-    return false;
+    out << "pc: 0x" << hex << getArmv7().registerGet(ArchitectureArmv7::REG_PC) << dec << endl;
+  }
+
+  void saveRegisters() {
+    SavedRegisters = readRegisters();
+  }
+
+  bool compareRegisters() {
+    return SavedRegisters == readRegisters();
   }
 
   void printRegisterMap(void) {
@@ -146,17 +143,15 @@ class CheckpointMarker : public HookCode {
   void run(hook_arg_t *arg) {
 
     if (post_checkpoint_address == arg->address) {
-      auto &Reg = getEmulator().getRegisters();
-
       cout << printLeader() << " Registers before checkpoint:" << endl;
       cout << RegBeforeStream.str() << endl;
       cout << endl;
 
       cout << printLeader() << " Registers after checkpoint: " << endl;
-      Reg.dump();
+      dumpRegisters(cout, readRegisters());
       cout << endl;
 
-      if (compareRegisters(Reg) == false) {
+      if (compareRegisters() == false) {
         // Check if a returned checkpoint call has the same registers
         cout << printLeader() << " FAILURE: REGISTERS ARE NOT THE SAME BEFORE AND AFTER THE CHECKPOINT/RESTORE!" << endl;
         cout << endl;
@@ -178,15 +173,16 @@ class CheckpointMarker : public HookCode {
     auto call_addr = getBrachAddress(arg->address, arg->size);
     if (call_addr == 0) return;
 
-    if (checkpoint_function != nullptr && checkpoint_function->getFuncAddr() == call_addr) {
+    Architecture &Arch = getEmulator().getArchitecture();
+    if (checkpoint_function != nullptr &&
+        Arch.getFunctionAddress(checkpoint_function->address) == call_addr) {
       // Get the registers before the call
-      auto &Reg = getEmulator().getRegisters();
-      saveRegisters(Reg);
+      saveRegisters();
       RegBeforeStream.str(string());
 
-      Reg.dump(RegBeforeStream);
+      dumpRegisters(RegBeforeStream, SavedRegisters);
 
-      auto PC = Reg.get(Registers::PC);
+      auto PC = getArmv7().registerGet(ArchitectureArmv7::REG_PC);
       auto NewPC = PC + arg->size;
 
       cout << printLeader() << " CHECKPOINT" << endl;
@@ -196,11 +192,11 @@ class CheckpointMarker : public HookCode {
       post_checkpoint_address = NewPC;
     }
 
-    else if (restore_function != nullptr && restore_function->getFuncAddr() == call_addr) {
+    else if (restore_function != nullptr &&
+             Arch.getFunctionAddress(restore_function->address) == call_addr) {
       cout << printLeader() << " RESTORE" << endl;
-      auto &Reg = getEmulator().getRegisters();
       cout << printLeader() << " Registers before restore:" << endl;
-      Reg.dump();
+      dumpRegisters(cout, readRegisters());
       cout << endl;
       found_restore = true;
     }
@@ -209,6 +205,11 @@ class CheckpointMarker : public HookCode {
 
 // Function that registers the hook
 static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
+  if (emu.getArch() != EMU_ARCH_ARMV7) {
+    cerr << "[checkpoint-side-effects] only supported for ARMv7" << endl;
+    return;
+  }
+
   auto mf = new CheckpointMarker(emu);
   if (mf->getStatus() == Hook::STATUS_ERROR) {
     delete mf;
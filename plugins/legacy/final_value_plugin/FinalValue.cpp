@@ -78,7 +78,12 @@ class FinalValue : public HookCode {
       }
 
       uint64_t value = 0;
-      auto *value_ptr = getEmulator().getMemory().at(fv->address);
+      auto *value_ptr = getEmulator().getMemory().at(fv->address, fv->size);
+      if (value_ptr == nullptr) {
+        cerr << printLeader() << " symbol " << fv->name << " is not mapped"
+             << endl;
+        continue;
+      }
       memcpy(&value, value_ptr, fv->size);
       cout << printLeader() << " final value for: " << fv->name << " = "
            << value << endl;
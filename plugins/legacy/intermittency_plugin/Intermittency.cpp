@@ -17,34 +17,15 @@
 #include "icemu/hooks/HookFunction.h"
 #include "icemu/hooks/HookManager.h"
 #include "icemu/hooks/RegisterHook.h"
-#include "icemu/emu/Function.h"
 
 using namespace std;
 using namespace icemu;
 
-// TODO: Need a way to get information from other hooks
-class HookInstructionCount : public HookCode {
- public:
-  uint64_t count = 0;
-  uint64_t pc = 0;
-
-  HookInstructionCount(Emulator &emu) : HookCode(emu, "icnt-intermittency") {
-  }
-
-  ~HookInstructionCount() {
-  }
-
-  void run(hook_arg_t *arg) {
-    //(void)arg;  // Don't care
-    ++count;
-    pc = arg->address;
-  }
-};
 struct InstructionState {
   uint64_t pc;
-  armaddr_t mem_address;
-  armaddr_t mem_value;
-  armaddr_t mem_size;
+  address_t mem_address;
+  address_t mem_value;
+  address_t mem_size;
 
   bool operator==(const InstructionState &is) const {
     return this->pc == is.pc && this->mem_address == is.mem_address &&
@@ -84,11 +65,11 @@ std::ostream& operator<<(std::ostream &o, const CheckpointRegion &cpr){
 }
 
 struct MemAccessState {
-  armaddr_t address;
-  armaddr_t value;
+  address_t address;
+  address_t value;
   uint64_t pc;
 
-  MemAccessState(armaddr_t address=0, armaddr_t value=0, uint64_t pc=0)
+  MemAccessState(address_t address=0, address_t value=0, uint64_t pc=0)
       : address(address), value(value), pc(pc) {}
 
   bool operator==(const MemAccessState& t) const{
@@ -193,7 +174,12 @@ class WarDetector {
 
 };
 
-// TODO: Need a way to get information from other hooks
+/*
+ * The power failures happen at the first execution of every memory access
+ * (not at a point in time), so they are requested from the memory hook. The
+ * PC of the access is read in the memory hook as well, instead of tracking
+ * it with a hook on every instruction.
+ */
 class HookIntermittency : public HookMemory {
  private:
   uint64_t new_instructions_count = 0;
@@ -217,8 +203,6 @@ class HookIntermittency : public HookMemory {
   }
 
  public:
-  HookInstructionCount *hook_instr_cnt;
-
   list<InstructionState> instructionOrder;
   list<InstructionState>::iterator instructionOrderIt;
 
@@ -230,7 +214,6 @@ class HookIntermittency : public HookMemory {
   list<WarViolation> warViolations;
 
   HookIntermittency(Emulator &emu) : HookMemory(emu, "intermittency") {
-    hook_instr_cnt = new HookInstructionCount(emu);
     resetInstructionTracker();
   }
 
@@ -266,13 +249,8 @@ class HookIntermittency : public HookMemory {
     // Reset the WAR detection
     warDetector.reset();
 
-    // Clear the volatile memory
-    Emulator &emu = getEmulator();
-    auto *vmem = emu.getMemory().find("RWMEM");
-    memset(vmem->data, 0, vmem->length); // Clear the volatile memory
-
-    // Reset the emulator
-    emu.reset();
+    // Clear the volatile memory and reset the emulator
+    getEmulator().powerFailure();
 
     resetInstructionTracker();
 
@@ -341,8 +319,8 @@ class HookIntermittency : public HookMemory {
 
   void run(hook_arg_t *arg) {
 
-    InstructionState istate = {hook_instr_cnt->pc, arg->address, arg->value,
-                               arg->size};
+    address_t pc = getEmulator().getArchitecture().registerGet(Architecture::REG_PC);
+    InstructionState istate = {pc, arg->address, arg->value, arg->size};
 
     if (arg->mem_type == MEM_READ) {
       uint64_t memval = 0;
@@ -430,11 +408,9 @@ class HookIntermittency : public HookMemory {
 static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
   auto mf = new HookIntermittency(emu);
   if (mf->getStatus() == Hook::STATUS_ERROR) {
-    delete mf->hook_instr_cnt;
     delete mf;
     return;
   }
-  HM.add(mf->hook_instr_cnt);
   HM.add(mf);
 }
 
@@ -10,6 +10,7 @@
 #include <map>
 
 #include "icemu/emu/Emulator.h"
+#include "icemu/hooks/HookBlock.h"
 #include "icemu/hooks/HookFunction.h"
 #include "icemu/hooks/HookManager.h"
 #include "icemu/hooks/RegisterHook.h"
@@ -19,19 +20,18 @@ using namespace std;
 using namespace icemu;
 
 // TODO: Need a way to get information from other hooks
-class HookInstructionCount : public HookCode {
+class HookInstructionCount : public HookBlock {
  public:
   uint64_t count = 0;
 
-  HookInstructionCount(Emulator &emu) : HookCode(emu, "icnt-ratio") {
+  HookInstructionCount(Emulator &emu) : HookBlock(emu, "icnt-ratio") {
   }
 
   ~HookInstructionCount() {
   }
 
   void run(hook_arg_t *arg) {
-    (void)arg;  // Don't care
-    ++count;
+    count += arg->icount;
   }
 };
 
@@ -41,6 +41,11 @@ class Powertrace : public HookCode {
 
   bool use_powertrace_input_file = false;
 
+  // Count time in executed instructions instead of modelled cycles. The
+  // power failures are then emulator events, so this hook only runs at the
+  // entry point (instead of for every instruction).
+  bool instruction_time = false;
+
   // Wait untill main before we start applying the powertrace
   bool bootstrap = true;
   const symbol_t *main_symbol;
@@ -79,6 +84,8 @@ class Powertrace : public HookCode {
         GetArguments(emu, "powertrace-stats-file=");
     auto powertrace_freq_arg =
         GetArguments(emu, "powertrace-freq=");
+    auto powertrace_time_arg =
+        GetArguments(emu, "powertrace-time=");
 
     if (stdev_arg.args.size()) stdev = std::stoi(stdev_arg.args[0]);
 
@@ -121,13 +128,32 @@ class Powertrace : public HookCode {
       powertrace_freq = std::stoi(powertrace_freq_arg.args[0]);
     }
 
-    // Find the main symbol for bootstrapping
-    try {
-      main_symbol = emu.getMemory().getSymbols().get("main");
-    } catch (...) {
-      cout << printLeader() << " could not find the main function"
-           << endl;
-      bootstrap = false;
+    if (powertrace_time_arg.args.size()) {
+      if (powertrace_time_arg.args[0] == "instructions") {
+        instruction_time = true;
+      } else if (powertrace_time_arg.args[0] != "cycles") {
+        cout << printLeader() << " unknown time: " << powertrace_time_arg.args[0]
+             << " (use cycles or instructions)" << endl;
+        setStatus(STATUS_ERROR);
+        return;
+      }
+    }
+
+    if (instruction_time) {
+      // The time of main is only known up to a slice, so the trace starts
+      // at the entry point (exactly at the start of the run)
+      cout << printLeader() << " counting time in instructions" << endl;
+      type = TYPE_RANGE;
+      low = high = emu.getArchitecture().getFunctionAddress(emu.getMemory().entrypoint);
+    } else {
+      // Find the main symbol for bootstrapping
+      try {
+        main_symbol = emu.getMemory().getSymbols().get("main");
+      } catch (...) {
+        cout << printLeader() << " could not find the main function"
+             << endl;
+        bootstrap = false;
+      }
     }
 
     /*
@@ -175,7 +201,7 @@ class Powertrace : public HookCode {
           ptsf << on_cycles << ",";
         }
         ptsf << stdev << ","
-          << cycleCounter.cycleCount() << ","
+          << now() << ","
           << reset_count
           << endl;
 
@@ -206,74 +232,113 @@ class Powertrace : public HookCode {
       cout << printLeader() << " ON-cycles: " << on_cycles << endl;
       cout << printLeader() << " ON-cycles stdev: " << stdev << endl;
     }
-    cout << printLeader() << " total cycle count: " << cycleCounter.cycleCount() << endl;
+    if (instruction_time) {
+      cout << printLeader() << " total instruction count: " << now() << endl;
+    } else {
+      cout << printLeader() << " total cycle count: " << now() << endl;
+    }
     cout << printLeader() << " total reset count: " << reset_count << endl;
   }
 
   void power_failure(uint64_t c) {
     // Trigger a power failure
-    // Reset the emulator
-    getEmulator().reset();
+    // Reset the emulator (and the volatile memory)
+    getEmulator().powerFailure();
     reset_count++;
     cout << printLeader() << " Power failure at: " << c << std::endl;
 
     setStatus(STATUS_SKIP_REST);
   }
 
+  // Current time (cycles or instructions)
+  uint64_t now() {
+    if (instruction_time) {
+      return getEmulator().getTime();
+    }
+    return cycleCounter.cycleCount();
+  }
+
+  // Time of the next power failure
+  uint64_t nextPowerFailure() {
+    if (use_powertrace_input_file) {
+      if (ResetCyclesReadIndex >= ResetCycles.size()) {
+        return UINT64_MAX;
+      }
+      return ResetCycles[ResetCyclesReadIndex] + tracefile_offset;
+    }
+    return last_power_off + on_cycles;
+  }
+
+  void startTrace(uint64_t c) {
+    bootstrap = false;
+    last_power_off = c;
+    tracefile_offset = c;
+    cout << printLeader() << " Finished bootstrap at: " << c << std::endl;
+  }
+
+  // Fail and move on in the trace
+  void nextTracePowerFailure(uint64_t c) {
+    power_failure(c);
+    last_power_off = c;
+
+    // Power trace file
+    if (use_powertrace_input_file) {
+      ResetCyclesReadIndex++;
+
+      // Loop the trace file
+      if (ResetCyclesReadIndex == ResetCycles.size()) {
+        cout << printLeader() << " Looping trace file" << endl;
+        ResetCyclesReadIndex = 0;
+        tracefile_offset += ResetCycles[ResetCycles.size()-1];
+      }
+
+    // Power trace generation
+    } else {
+      ResetCycles.push_back(c);
+    }
+  }
+
+  // Let the emulator fail at the next time in the trace (instruction time)
+  void schedulePowerFailure() {
+    uint64_t t = nextPowerFailure();
+    if (t == UINT64_MAX) {
+      return;
+    }
+
+    getEmulator().getEventQueue().schedule(t, name, [this]() {
+      nextTracePowerFailure(getEmulator().getTime());
+      schedulePowerFailure();
+    });
+  }
+
   // Hook run
   void run(hook_arg_t *arg) {
     if (on_cycles > 0 || use_powertrace_input_file) {
 
       setStatus(STATUS_OK);
 
-      // Get the current cycle count
-      auto c = cycleCounter.cycleCount();
-
-      // Power trace file
-      if (use_powertrace_input_file) {
+      // Only called at the entry point, after the first boot everything
+      // happens in the events
+      if (instruction_time) {
         if (bootstrap) {
-          if (arg->address == main_symbol->getFuncAddr()) {
-            // Start the actual powertrace
-            bootstrap = false;
-            last_power_off = c;
-            tracefile_offset = c;
-            cout << printLeader() << " Finished bootstrap at: " << c << std::endl;
-          }
-        } else if ((ResetCyclesReadIndex < ResetCycles.size()) &&
-            (c >= (ResetCycles[ResetCyclesReadIndex]+tracefile_offset))) {
-          power_failure(c);
-
-          last_power_off = c;
-          ResetCyclesReadIndex++;
-
-          // Loop the trace file
-          if (ResetCyclesReadIndex == ResetCycles.size()) {
-            cout << printLeader() << " Looping trace file" << endl;
-            ResetCyclesReadIndex = 0;
-            tracefile_offset += ResetCycles[ResetCycles.size()-1];
-          }
-
-          return;
+          startTrace(now());
+          schedulePowerFailure();
         }
+        return;
+      }
 
-      // Power trace generation
-      } else {
-        if (bootstrap) {
-          if (arg->address == main_symbol->getFuncAddr()) {
-            // Start the actual powertrace
-            bootstrap = false;
-            last_power_off = c;
-            cout << printLeader() << " Finished bootstrap at: " << c << std::endl;
-          }
-        }
-        // Power failure time?
-        else if (c >= (last_power_off + on_cycles)) {
-          power_failure(c);
+      // Get the current cycle count
+      auto c = cycleCounter.cycleCount();
 
-          last_power_off = c;
-          ResetCycles.push_back(c);
-          return;
+      if (bootstrap) {
+        if (arg->address == main_symbol->getFuncAddr()) {
+          // Start the actual powertrace
+          startTrace(c);
         }
+      } else if (c >= nextPowerFailure()) {
+        // Power failure time?
+        nextTracePowerFailure(c);
+        return;
       }
     }
 
@@ -9,6 +9,7 @@
 #include <iostream>
 
 #include "icemu/emu/Emulator.h"
+#include "icemu/hooks/HookBlock.h"
 #include "icemu/hooks/HookFunction.h"
 #include "icemu/hooks/HookManager.h"
 #include "icemu/hooks/RegisterHook.h"
@@ -17,11 +18,11 @@ using namespace std;
 using namespace icemu;
 
 // TODO: Need a way to get information from other hooks
-class HookInstructionCount : public HookCode {
+class HookInstructionCount : public HookBlock {
  public:
   uint64_t icnt = 0;
 
-  HookInstructionCount(Emulator &emu) : HookCode(emu, "icnt-clock") {
+  HookInstructionCount(Emulator &emu) : HookBlock(emu, "icnt-clock") {
   }
 
   ~HookInstructionCount() {
@@ -29,18 +30,30 @@ class HookInstructionCount : public HookCode {
   }
 
   void run(hook_arg_t *arg) {
-    (void)arg;  // Don't care
-    ++icnt;
+    icnt += arg->icount;
   }
 };
 
 
-class MockClockfunc : public HookFunction {
+class MockClockfuncBase : public HookFunction {
  public:
   HookInstructionCount *hook_instr_cnt;
 
+  MockClockfuncBase(Emulator &emu, string fname) : HookFunction(emu, fname) {
+  }
+};
+
+// Instantiated per architecture, so the return handling inlines to direct
+// register writes
+template <class ArchImpl>
+class MockClockfunc : public MockClockfuncBase {
+ private:
+  TypedArchitecture<ArchImpl> arch_;
+
+ public:
   // Always execute
-  MockClockfunc(Emulator &emu, string fname) : HookFunction(emu, fname) {
+  MockClockfunc(Emulator &emu, string fname)
+      : MockClockfuncBase(emu, fname), arch_(emu.getArchitecture()) {
     hook_instr_cnt = new HookInstructionCount(emu);
   }
 
@@ -50,15 +63,27 @@ class MockClockfunc : public HookFunction {
   // Hook run
   void run(hook_arg_t *arg) {
     (void)arg;
-    auto &arch = getArchitecture();
-    arch.functionSetReturn((uint64_t)hook_instr_cnt->icnt);
-    arch.functionSkip();
+    arch_.functionSetReturn((uint64_t)hook_instr_cnt->icnt);
+    arch_.functionSkip();
   }
 };
 
 // Function that registers the hook
 static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
-  auto mf = new MockClockfunc(emu, "clock");
+  MockClockfuncBase *mf;
+  switch (emu.getArch()) {
+    case EMU_ARCH_ARMV7:
+      mf = new MockClockfunc<ArchitectureArmv7>(emu, "clock");
+      break;
+    case EMU_ARCH_RISCV32:
+      mf = new MockClockfunc<ArchitectureRiscv32>(emu, "clock");
+      break;
+    case EMU_ARCH_RISCV64:
+      mf = new MockClockfunc<ArchitectureRiscv64>(emu, "clock");
+      break;
+    default:
+      return;
+  }
   if (mf->getStatus() == Hook::STATUS_ERROR) {
     delete mf->hook_instr_cnt;
     delete mf;
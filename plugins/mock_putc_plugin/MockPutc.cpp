@@ -22,7 +22,12 @@
 using namespace std;
 using namespace icemu;
 
+// Instantiated per architecture, so the argument and return handling
+// inline to direct register accesses
+template <class ArchImpl>
 class MockPutc : public HookFunction {
+ private:
+  TypedArchitecture<ArchImpl> arch_;
 
  public:
   bool use_color = true;
@@ -37,7 +42,8 @@ class MockPutc : public HookFunction {
   }
 
   // Always execute
-  MockPutc(Emulator &emu, string fname) : HookFunction(emu, fname) {
+  MockPutc(Emulator &emu, string fname)
+      : HookFunction(emu, fname), arch_(emu.getArchitecture()) {
     // Get where to store the log file (if any)
     auto name_arg = PluginArgumentParsing::GetArguments(emu, "putc-logfile=");
     if (name_arg.size()) {
@@ -57,9 +63,8 @@ class MockPutc : public HookFunction {
   void run(hook_arg_t *arg) {
     (void)arg;
 
-    auto &arch = getEmulator().getArchitecture();
-    char arg_char = arch.functionGetArgument(0);
-    //uint32_t arg_file = arch.functionGetArgument(1); // Unused
+    char arg_char = arch_.functionGetArgument(0);
+    //uint32_t arg_file = arch_.functionGetArgument(1); // Unused
 
     cout << color_start << arg_char << color_end;
 
@@ -67,14 +72,27 @@ class MockPutc : public HookFunction {
       output_file_stream << arg_char;
     }
 
-    arch.functionSetReturn((uint32_t)arg_char); // Return the character that was printed
-    arch.functionSkip();
+    arch_.functionSetReturn((uint32_t)arg_char); // Return the character that was printed
+    arch_.functionSkip();
   }
 };
 
 // Function that registers the hook
 static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
-  auto mf = new MockPutc(emu, "putc");
+  HookFunction *mf;
+  switch (emu.getArch()) {
+    case EMU_ARCH_ARMV7:
+      mf = new MockPutc<ArchitectureArmv7>(emu, "putc");
+      break;
+    case EMU_ARCH_RISCV32:
+      mf = new MockPutc<ArchitectureRiscv32>(emu, "putc");
+      break;
+    case EMU_ARCH_RISCV64:
+      mf = new MockPutc<ArchitectureRiscv64>(emu, "putc");
+      break;
+    default:
+      return;
+  }
   if (mf->getStatus() == Hook::STATUS_ERROR) {
     delete mf;
     return;
@@ -7,7 +7,7 @@
 #include <string.h>
 
 #include "icemu/emu/Emulator.h"
-#include "icemu/hooks/HookFunction.h"
+#include "icemu/emu/MmioDevice.h"
 #include "icemu/hooks/HookManager.h"
 #include "icemu/hooks/RegisterHook.h"
 
@@ -20,9 +20,10 @@ using namespace icemu;
 
 // Function that registers the hook
 static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
+  (void)HM;
   auto p = new RiscvXXRocketchipSyscall<uint32_t>(emu); // 32-bit version
   if (p->good) {
-    HM.add(p);
+    emu.addMmioDevice(p);
   } else {
     delete p;
   }
@@ -36,7 +36,7 @@
 #include <string.h>
 
 #include "icemu/emu/Emulator.h"
-#include "icemu/hooks/HookFunction.h"
+#include "icemu/emu/MmioDevice.h"
 #include "icemu/hooks/HookManager.h"
 #include "icemu/hooks/RegisterHook.h"
 
@@ -49,9 +49,10 @@ using namespace icemu;
 
 // Function that registers the hook
 static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
+  (void)HM;
   auto p = new RiscvXXRocketchipSyscall<uint64_t>(emu);
   if (p->good) {
-    HM.add(p);
+    emu.addMmioDevice(p);
   } else {
     delete p;
   }
@@ -2,8 +2,18 @@
 /**
  *  ICEmu loadable plugin (library)
  *
- *  Parses the tohost syscall message from rocketchip
+ *  The host target interface (HTIF) of rocketchip and spike, the tohost and
+ *  fromhost words. A write to tohost is a command for the host:
  *
+ *    device (63:56), command (55:48), payload (47:0)
+ *
+ *    device 0 (syscall), command 0:
+ *      payload & 1:  exit with code payload >> 1 (riscv-tests, pk)
+ *      otherwise:    system call, the payload is the address of magic_mem
+ *    device 1 (console), command 0: read a character, command 1: write one
+ *
+ *  The command is done right away and acknowledged in fromhost (tohost is
+ *  cleared), so the guest never waits for the host. e.g.,
 
     #define SYS_write 64
 
@@ -18,12 +28,12 @@
       magic_mem[2] = arg1;
       magic_mem[3] = arg2;
       __sync_synchronize();
-    
+
       tohost = (uintptr_t)magic_mem;
       while (fromhost == 0)
         ;
       fromhost = 0;
-  
+
       __sync_synchronize();
       return magic_mem[0];
     }
@@ -32,22 +42,32 @@
     {
       syscall(SYS_write, 1, (uintptr_t)s, strlen(s));
     }
+
+ *  The system calls are served by the SyscallProxy (write, read, open,
+ *  close, lseek, fstat, exit and brk).
+ *
+ *  arguments:
+ *    syscall-print-logfile=<file_to_copy_the_console_output_to>
  */
 #include <iostream>
 #include <string.h>
 
 #include "icemu/emu/Emulator.h"
-#include "icemu/hooks/HookFunction.h"
+#include "icemu/emu/MmioDevice.h"
 #include "icemu/hooks/HookManager.h"
 #include "icemu/hooks/RegisterHook.h"
 
 #include "PluginArgumentParsing.h"
+#include "SyscallProxy.h"
 
 /*
  * Select 64 bit or 32 bit
+ * A device on the page of tohost, so only the accesses to that page leave
+ * the JIT (instead of checking every load and store). On RV32 the 64-bit
+ * tohost is written as two words, the command is the write of the low word.
  */
 template <class T>
-class RiscvXXRocketchipSyscall : public icemu::HookMemory {
+class RiscvXXRocketchipSyscall : public icemu::MmioDevice {
  public:
   typedef T sys_t;
 
@@ -55,34 +75,78 @@ class RiscvXXRocketchipSyscall : public icemu::HookMemory {
   const icemu::symbol_t *to_host;
   const icemu::symbol_t *from_host;
 
-  char *mem_to_host;
-  char *mem_from_host;
+  SyscallProxy<sys_t> proxy;
+
+  // fesvr's magic_mem, the system call number and its arguments
+  static const unsigned magic_mem_words = 8;
 
-  const T SYS_write = 64;
+  const uint64_t device_syscall = 0;
+  const uint64_t device_console = 1;
+  const uint64_t console_read = 0;
+  const uint64_t console_write = 1;
 
   std::string printLeader() {
     return "[syscall] ";
   }
 
-  std::string color_start = "\033[1m";
-  std::string color_end = "\033[0m";
+  void writeWord(address_t address, uint64_t value) {
+    writeBacking(address, sizeof(uint64_t), value);
+  }
 
-  std::string output_file;
-  std::ofstream output_file_stream;
+  // Acknowledge the command, the guest waits for fromhost != 0
+  void acknowledge(uint64_t device, uint64_t command, uint64_t payload) {
+    writeWord(to_host->address, 0);
+    writeWord(from_host->address, (device << 56) | (command << 48) | payload);
+  }
 
- public:
-  bool good = true;
-  RiscvXXRocketchipSyscall(icemu::Emulator &emu) : HookMemory(emu, "syscall") {
-    // Get where to store the log file (if any)
-    auto name_arg = PluginArgumentParsing::GetArguments(emu, "syscall-print-logfile=");
-    if (name_arg.size()) {
-      output_file = name_arg[0];
-
-      // Open the output file
-      output_file_stream.open(output_file, std::ios::out);
-      std::cout << printLeader() << " writing output to: " << output_file << std::endl;
+  void syscall(uint64_t magic_mem_address) {
+    icemu::MemoryView &mem = getEmulator().getMemoryView();
+
+    sys_t magic_mem[magic_mem_words];
+    if (!mem.read(magic_mem_address, magic_mem, sizeof(magic_mem))) {
+      std::cerr << printLeader() << "magic memory at 0x" << std::hex << magic_mem_address
+                << std::dec << " is not mapped" << std::endl;
+      getEmulator().stop("invalid tohost command");
+      return;
     }
 
+    // The return value goes in the first word
+    magic_mem[0] = proxy.call(magic_mem[0], &magic_mem[1]);
+    mem.write(magic_mem_address, &magic_mem[0], sizeof(sys_t));
+
+    if (!proxy.exited()) {
+      acknowledge(device_syscall, 0, 1);
+    }
+  }
+
+  void command(uint64_t value) {
+    uint64_t device = value >> 56;
+    uint64_t cmd = (value >> 48) & 0xff;
+    uint64_t payload = value & (((uint64_t)1 << 48) - 1);
+
+    if (device == device_syscall && cmd == 0) {
+      if (payload & 1) {
+        proxy.exitProgram(payload >> 1);
+      } else {
+        syscall(payload);
+      }
+    } else if (device == device_console && cmd == console_write) {
+      proxy.putChar((char)(payload & 0xff));
+      acknowledge(device_console, console_write, 0);
+    } else if (device == device_console && cmd == console_read) {
+      int c = proxy.getChar();
+      acknowledge(device_console, console_read, c < 0 ? 0 : (uint64_t)c);
+    } else {
+      std::cerr << printLeader() << "unsupported tohost command 0x" << std::hex << value
+                << std::dec << std::endl;
+      acknowledge(device, cmd, 0);
+    }
+  }
+
+ public:
+  bool good = true;
+  RiscvXXRocketchipSyscall(icemu::Emulator &emu)
+      : MmioDevice(emu, "syscall", 0, 0), proxy(emu, printLeader(), "syscall-print") {
     // Setup the hook
     icemu::Symbols &sym = getEmulator().getMemory().getSymbols();
 
@@ -100,57 +164,23 @@ class RiscvXXRocketchipSyscall : public icemu::HookMemory {
       return;
     }
 
-    // Get the pointer to the emulator memoroy
-    mem_to_host = getEmulator().getMemory().at(to_host->address);
-    mem_from_host = getEmulator().getMemory().at(from_host->address);
-
+    // The device window is the page of tohost, fromhost is plain memory
+    // that the device writes (and the guest polls) without leaving the JIT
+    base = to_host->address;
+    size = sizeof(uint64_t);
   }
 
   ~RiscvXXRocketchipSyscall() {
-    std::cout << color_end;
-    if (output_file_stream.is_open()) output_file_stream.close();
   }
 
-  // Hook run (at every memory access)
-  void run(hook_arg_t *arg) {
-    address_t addr = arg->address;
-    if ((addr == to_host->address) && (arg->mem_type == MEM_WRITE)) {
-
-      // Read the arguments
-      sys_t magic_mem[8];
-
-      // Memory write did not yet happen, but is being written
-      sys_t magic_mem_address = arg->value;
-      char *host_magic_mem_address = getEmulator().getMemory().at(magic_mem_address);
-
-      // Copy the magic mem (we don't know if we can access it on the host directly due to allignment)
-      memcpy(magic_mem, host_magic_mem_address, sizeof(magic_mem));
-
-      // Get the fields (from syscall)
-      sys_t which = magic_mem[0];
-      sys_t arg0 = magic_mem[1];
-      sys_t arg1 = magic_mem[2];
-      sys_t arg2 = magic_mem[3];
-
-      if (which == SYS_write && arg0 == 1) {
-        // For printing
-        sys_t buffer_addr = arg1;
-        sys_t buffer_len = arg2; // size of string without the '\0'
-
-        char *buffer_host_addr = getEmulator().getMemory().at(buffer_addr);
-        std::cout << color_start;
-        for (size_t i=0; i<buffer_len; i++) {
-          char c = buffer_host_addr[i];
-          std::cout << c;
-          if (output_file_stream.is_open()) {
-            output_file_stream << c;
-          }
-        }
-        std::cout << color_end;
-      }
+  // Device write (only for accesses to the page of tohost, which might
+  // hold fromhost as well)
+  void write(address_t address, unsigned access_size, uint64_t value) {
+    // The rest of the page is plain memory
+    writeBacking(address, access_size, value);
 
-      // Set the from_host to 1 signalling that the syscall can continue
-      // *mem_from_host = 1;
+    if (address == to_host->address && value != 0) {
+      command(value);
     }
   }
 };
@@ -0,0 +1,220 @@
+/**
+ *  ICEmu loadable plugin (library)
+ *
+ *  The core local interruptor (CLINT) of rocketchip/SiFive RISC-V cores,
+ *  with msip, mtimecmp and mtime for every hart. mtime is computed from the
+ *  emulated time (see Emulator::getTime()) when it is read, and the timer
+ *  interrupt is an event at the time mtime reaches mtimecmp. So the timer
+ *  costs nothing per instruction.
+ *
+ *  NB. In an access to the device the emulated time counts the block that
+ *  accesses it as a whole. The interrupts happen at the exact time.
+ *
+ *  arguments:
+ *    clint-base=<address> (default 0x2000000)
+ *    clint-divider=<instructions per mtime tick> (default 1)
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "icemu/emu/Emulator.h"
+#include "icemu/emu/EventQueue.h"
+#include "icemu/emu/MmioDevice.h"
+#include "icemu/hooks/HookManager.h"
+#include "icemu/hooks/RegisterHook.h"
+
+#include "PluginArgumentParsing.h"
+
+using namespace std;
+using namespace icemu;
+
+class RiscvClint : public MmioDevice {
+ private:
+  const address_t msip_offset = 0x0;
+  const address_t mtimecmp_offset = 0x4000;
+  const address_t mtime_offset = 0xBFF8;
+  const address_t clint_size = 0xC000;
+
+  // Interrupt causes
+  const unsigned irq_software = 3;
+  const unsigned irq_timer = 7;
+
+  uint64_t divider = 1;
+
+  // mtime = mtime_base + (time - time_base) / divider
+  uint64_t mtime_base = 0;
+  uint64_t time_base = 0;
+
+  struct HartTimer {
+    uint32_t msip = 0;
+    uint64_t mtimecmp = ~(uint64_t)0;
+    EventQueue::event_id_t event = 0;
+  };
+  vector<HartTimer> harts;
+
+  string printLeader() {
+    return "[clint] ";
+  }
+
+  uint64_t mtime() {
+    return mtime_base + (getEmulator().getTime() - time_base) / divider;
+  }
+
+  // Part of a 64-bit register (32-bit accesses on RV32)
+  static uint64_t readPart(uint64_t reg, address_t offset, unsigned size) {
+    uint64_t value = reg >> (8 * offset);
+    return size >= 8 ? value : value & (((uint64_t)1 << (8 * size)) - 1);
+  }
+
+  static uint64_t writePart(uint64_t reg, address_t offset, unsigned size, uint64_t value) {
+    uint64_t mask = size >= 8 ? ~(uint64_t)0 : ((uint64_t)1 << (8 * size)) - 1;
+    return (reg & ~(mask << (8 * offset))) | ((value & mask) << (8 * offset));
+  }
+
+  // The timer interrupt is pending while mtime >= mtimecmp, otherwise raise
+  // it when mtime gets there
+  void updateTimer(unsigned hart) {
+    Emulator &emu = getEmulator();
+    HartTimer &h = harts[hart];
+
+    emu.getEventQueue().cancel(h.event);
+    if (mtime() >= h.mtimecmp) {
+      emu.raiseInterrupt(hart, irq_timer);
+      return;
+    }
+    emu.clearInterrupt(hart, irq_timer);
+
+    // mtime does not get there before emulated time runs out
+    uint64_t ticks = h.mtimecmp - mtime_base;
+    if (ticks > (EventQueue::never - time_base) / divider) {
+      return;
+    }
+
+    h.event = emu.getEventQueue().schedule(
+        time_base + ticks * divider, "clint-mtimecmp",
+        [this, hart]() { getEmulator().raiseInterrupt(hart, irq_timer); });
+  }
+
+ public:
+  bool good = true;
+
+  RiscvClint(Emulator &emu) : MmioDevice(emu, "clint", 0x2000000, 0) {
+    auto base_arg = PluginArgumentParsing::GetArguments(emu, "clint-base=");
+    auto divider_arg = PluginArgumentParsing::GetArguments(emu, "clint-divider=");
+    if (base_arg.size()) {
+      base = stoull(base_arg[0], nullptr, 0);
+    }
+    if (divider_arg.size()) {
+      divider = stoull(divider_arg[0], nullptr, 0);
+    }
+    if (divider == 0) {
+      cerr << printLeader() << "the divider must be at least one instruction per tick" << endl;
+      good = false;
+      return;
+    }
+
+    size = clint_size;
+    harts.resize(emu.getHartCount());
+    time_base = emu.getTime();
+
+    cout << printLeader() << "at 0x" << hex << base << dec << ", mtime ticks every "
+         << divider << " instructions" << endl;
+  }
+
+  ~RiscvClint() {
+  }
+
+  uint64_t read(address_t address, unsigned access_size) {
+    if (address < base || address >= base + size) {
+      return readBacking(address, access_size);
+    }
+
+    address_t offset = address - base;
+    const address_t hart_count = harts.size();
+    if (offset >= msip_offset && offset < msip_offset + 4 * hart_count) {
+      const HartTimer &h = harts[(offset - msip_offset) / 4];
+      return readPart(h.msip, (offset - msip_offset) % 4, access_size);
+    }
+    if (offset >= mtimecmp_offset && offset < mtimecmp_offset + 8 * hart_count) {
+      const HartTimer &h = harts[(offset - mtimecmp_offset) / 8];
+      return readPart(h.mtimecmp, (offset - mtimecmp_offset) % 8, access_size);
+    }
+    if (offset >= mtime_offset && offset < mtime_offset + 8) {
+      return readPart(mtime(), offset - mtime_offset, access_size);
+    }
+
+    // Reserved
+    return 0;
+  }
+
+  // mtime counts with the time
+  bool readDependsOnTime(address_t address) {
+    return address >= base + mtime_offset && address < base + mtime_offset + 8;
+  }
+
+  void write(address_t address, unsigned access_size, uint64_t value) {
+    if (address < base || address >= base + size) {
+      writeBacking(address, access_size, value);
+      return;
+    }
+
+    Emulator &emu = getEmulator();
+    address_t offset = address - base;
+    const address_t hart_count = harts.size();
+    if (offset >= msip_offset && offset < msip_offset + 4 * hart_count) {
+      unsigned hart = (offset - msip_offset) / 4;
+      if ((offset - msip_offset) % 4 == 0) {
+        harts[hart].msip = value & 1;
+        if (harts[hart].msip) {
+          emu.raiseInterrupt(hart, irq_software);
+        } else {
+          emu.clearInterrupt(hart, irq_software);
+        }
+      }
+    } else if (offset >= mtimecmp_offset && offset < mtimecmp_offset + 8 * hart_count) {
+      unsigned hart = (offset - mtimecmp_offset) / 8;
+      HartTimer &h = harts[hart];
+      h.mtimecmp = writePart(h.mtimecmp, (offset - mtimecmp_offset) % 8, access_size, value);
+      updateTimer(hart);
+    } else if (offset >= mtime_offset && offset < mtime_offset + 8) {
+      mtime_base = writePart(mtime(), offset - mtime_offset, access_size, value);
+      time_base = emu.getTime();
+      for (unsigned hart = 0; hart < hart_count; hart++) {
+        updateTimer(hart);
+      }
+    }
+  }
+
+  void reset() {
+    // The interrupts are already cleared by the emulator
+    for (auto &h : harts) {
+      getEmulator().getEventQueue().cancel(h.event);
+      h = HartTimer();
+    }
+    mtime_base = 0;
+    time_base = getEmulator().getTime();
+  }
+};
+
+// Function that registers the hook
+static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
+  (void)HM;
+
+  if (emu.getArch() == EMU_ARCH_ARMV7) {
+    cerr << "[clint] the CLINT is only supported for RISC-V" << endl;
+    return;
+  }
+
+  auto p = new RiscvClint(emu);
+  if (p->good) {
+    emu.addMmioDevice(p);
+  } else {
+    delete p;
+  }
+}
+
+// Class that is used by ICEmu to finf the register function
+// NB.  * MUST BE NAMED "RegisterMyHook"
+//      * MUST BE global
+RegisterHook RegisterMyHook(registerMyCodeHook);
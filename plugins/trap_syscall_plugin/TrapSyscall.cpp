@@ -0,0 +1,137 @@
+/**
+ *  ICEmu loadable plugin (library)
+ *
+ *  Serves the system calls of the emulated code from the host (see
+ *  SyscallProxy.h), so unmodified newlib (pk) binaries run. The system calls
+ *  trap to the interrupt hook, only the ecall/svc instructions cost
+ *  something.
+ *
+ *    RISC-V: ecall, number in a7, arguments in a0-a5, result in a0
+ *    ARMv7:  svc 0, number in r7, arguments in r0-r5, result in r0 (the ARM
+ *            EABI numbers)
+ *
+ *  arguments:
+ *    syscall-logfile=<file_to_copy_the_console_output_to>
+ */
+#include <iostream>
+#include <map>
+
+#include "icemu/emu/Emulator.h"
+#include "icemu/emu/RegisterCache.h"
+#include "icemu/hooks/HookInterrupt.h"
+#include "icemu/hooks/HookManager.h"
+#include "icemu/hooks/RegisterHook.h"
+
+#include "SyscallProxy.h"
+
+using namespace std;
+using namespace icemu;
+
+template <class T>
+class TrapSyscall : public HookInterrupt {
+ private:
+  typedef SyscallProxy<T> proxy_t;
+
+  // Exception numbers in unicorn
+  const uint32_t riscv_excp_u_ecall = 8;
+  const uint32_t riscv_excp_s_ecall = 9;
+  const uint32_t riscv_excp_m_ecall = 11;
+  const uint32_t arm_excp_swi = 2;
+
+  const uint16_t arm_svc_0 = 0xdf00;
+
+  proxy_t proxy_;
+  bool arm_;
+
+  // ARM EABI system call numbers to the newlib/pk ones
+  map<T, T> arm_syscalls_ = {
+      {1, proxy_t::SYS_exit},    {3, proxy_t::SYS_read},
+      {4, proxy_t::SYS_write},   {5, proxy_t::SYS_open},
+      {6, proxy_t::SYS_close},   {19, proxy_t::SYS_lseek},
+      {45, proxy_t::SYS_brk},    {108, proxy_t::SYS_fstat},
+      {248, proxy_t::SYS_exit_group}, {322, proxy_t::SYS_openat},
+  };
+
+  bool isSyscall(hook_arg_t *arg) {
+    if (!arm_) {
+      return arg->intno == riscv_excp_u_ecall || arg->intno == riscv_excp_s_ecall ||
+             arg->intno == riscv_excp_m_ecall;
+    }
+
+    // The PC is already past the svc
+    uint16_t instruction = 0;
+    return arg->intno == arm_excp_swi &&
+           getEmulator().getMemoryView().load((arg->address & ~1) - 2, instruction) &&
+           instruction == arm_svc_0;
+  }
+
+ public:
+  TrapSyscall(Emulator &emu)
+      : HookInterrupt(emu, "trap-syscall"),
+        proxy_(emu, "[syscall] ", "syscall", emu.getArch() == EMU_ARCH_ARMV7),
+        arm_(emu.getArch() == EMU_ARCH_ARMV7) {
+  }
+
+  ~TrapSyscall() {
+  }
+
+  // Hook run
+  void run(hook_arg_t *arg) {
+    if (!isSyscall(arg)) {
+      return;
+    }
+
+    uc_engine *uc = getEmulator().getUnicornEngine();
+    const int riscv_regs[] = {UC_RISCV_REG_X17, UC_RISCV_REG_X10, UC_RISCV_REG_X11,
+                              UC_RISCV_REG_X12, UC_RISCV_REG_X13, UC_RISCV_REG_X14,
+                              UC_RISCV_REG_X15};
+    const int arm_regs[] = {UC_ARM_REG_R7, UC_ARM_REG_R0, UC_ARM_REG_R1, UC_ARM_REG_R2,
+                            UC_ARM_REG_R3, UC_ARM_REG_R4, UC_ARM_REG_R5};
+    const int *regs = arm_ ? arm_regs : riscv_regs;
+
+    // The number and the arguments
+    T values[1 + proxy_t::max_args];
+    registerReadBatch(uc, regs, values, 1 + proxy_t::max_args);
+
+    T which = values[0];
+    if (arm_) {
+      auto s = arm_syscalls_.find(which);
+      which = s == arm_syscalls_.end() ? ~(T)0 : s->second;
+    }
+
+    T result = proxy_.call(which, &values[1]);
+    if (proxy_.exited()) {
+      // Shows up as the result register
+      result = proxy_.getExitCode();
+    }
+    uc_reg_write(uc, regs[1], &result);
+
+    // Continue after the ecall, the PC is already past the svc
+    if (!arm_) {
+      T pc = arg->address + 4;
+      uc_reg_write(uc, UC_RISCV_REG_PC, &pc);
+    }
+    arg->registers->invalidate();
+    arg->handled = true;
+  }
+};
+
+// Function that registers the hook
+static void registerMyCodeHook(Emulator &emu, HookManager &HM) {
+  switch (emu.getArch()) {
+    case EMU_ARCH_ARMV7:
+    case EMU_ARCH_RISCV32:
+      HM.add(new TrapSyscall<uint32_t>(emu));
+      break;
+    case EMU_ARCH_RISCV64:
+      HM.add(new TrapSyscall<uint64_t>(emu));
+      break;
+    default:
+      return;
+  }
+}
+
+// Class that is used by ICEmu to finf the register function
+// NB.  * MUST BE NAMED "RegisterMyHook"
+//      * MUST BE global
+RegisterHook RegisterMyHook(registerMyCodeHook);
@@ -27,9 +27,18 @@ bool ArgParse::parse(int argc, char **argv) {
     desc.add_options()
         ("help,h", "produce help message")
         ("elf-file,e", po::value<string>(), "elf input file")
-        ("memory-region,m", po::value< vector<string> >(), "memory region: NAME:HEX_ORIGIN:SIZE e.g., RWMEM:0x10000000:384K (can be passed multiple times)")
+        ("memory-region,m", po::value< vector<string> >(), "memory region: NAME:HEX_ORIGIN:SIZE[:OPTIONS] e.g., RWMEM:0x10000000:384K:volatile (can be passed multiple times), OPTIONS is a comma separated list of: volatile, nonvolatile (default), hugepages, sparse (mapped on first access), file=PATH (persistent, shared with PATH), permissions as a combination of r, w and x (default rwx), elf (the pages of the program segments get the segment permissions, the rest rw)")
         ("plugin,p", po::value< vector<string> >(), "load plugin (can be passed multiple times)")
-        ("plugin-arg,a", po::value< vector<string> >(), "arguments accessable to the plugins");
+        ("plugin-arg,a", po::value< vector<string> >(), "arguments accessable to the plugins")
+        ("max-instructions", po::value<uint64_t>()->default_value(0), "stop after executing this many instructions (0 = no limit)")
+        ("time-limit", po::value<double>()->default_value(0), "stop after running for this many seconds (0 = no limit)")
+        ("slice-instructions", po::value<uint64_t>()->default_value(1000000), "number of instructions executed between checking for stop requests and limits")
+        ("harts", po::value<unsigned>()->default_value(1), "number of harts (RISC-V), every hart starts at the entry point with its hart id in a0 (and mhartid)")
+        ("quantum", po::value<uint64_t>()->default_value(1000), "number of instructions a hart executes before the next hart runs (with multiple harts)")
+        ("no-idle-detection", po::bool_switch()->default_value(false), "keep running loops that spin without side effects, instead of skipping to the next event (or stopping if there is none)")
+        ("tb-warmup", po::bool_switch()->default_value(false), "translate the executable segments before starting the emulation")
+        ("tb-warmup-file", po::value<string>(), "translate the blocks listed in this file (see --tb-profile) before starting the emulation")
+        ("tb-profile", po::value<string>(), "write the addresses of the executed blocks to this file");
 
     po::positional_options_description p;
     p.add("elf-file", -1);
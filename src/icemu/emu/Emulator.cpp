@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
 
 #include <capstone/capstone.h>
@@ -5,164 +10,1898 @@
 
 #include "icemu/emu/Memory.h"
 #include "icemu/emu/Emulator.h"
+#include "icemu/emu/MmioDevice.h"
 #include "icemu/hooks/HookManager.h"
 
 using namespace std;
 using namespace icemu;
 
+Emulator::Emulator(Arch arch, Config &cfg, Memory &mem) : cfg_(cfg), mem_(mem), mem_view_(mem) {
+  /* Set the emulator architecture */
+  arch_ = arch;
+
+  uc_arch core = UC_ARCH_ARM;
+  uc_mode core_mode = UC_MODE_ARM;
+
+  /*
+   * Select the correct core and initialize the capstone engine
+   */
+  switch (arch_) {
+    case EMU_ARCH_ARMV7:
+      core = UC_ARCH_ARM;
+      core_mode = (uc_mode)(UC_MODE_THUMB | UC_MODE_MCLASS);
+      if (cs_open(CS_ARCH_ARM, (cs_mode)(CS_MODE_THUMB | CS_MODE_MCLASS), &cs) !=
+          CS_ERR_OK) {
+        cerr << "Failed to initialize capstone engine" << endl;
+        good_ = false;
+        assert(false);
+      }
+      break;
+
+    case EMU_ARCH_RISCV32:
+      core = UC_ARCH_RISCV;
+      core_mode = UC_MODE_RISCV32;
+      if (cs_open(CS_ARCH_RISCV, (cs_mode)(CS_MODE_RISCV32 | CS_MODE_RISCVC), &cs) !=
+          CS_ERR_OK) {
+        cerr << "Failed to initialize capstone engine" << endl;
+        good_ = false;
+        assert(false);
+      }
+      break;
+
+    case EMU_ARCH_RISCV64:
+      core = UC_ARCH_RISCV;
+      core_mode = UC_MODE_RISCV64;
+      if (cs_open(CS_ARCH_RISCV, (cs_mode)(CS_MODE_RISCV64 | CS_MODE_RISCVC), &cs) !=
+          CS_ERR_OK) {
+        cerr << "Failed to initialize capstone engine" << endl;
+        good_ = false;
+        assert(false);
+      }
+      break;
+
+    default:
+      cerr << "Unknown architecture" << endl;
+      good_ = false;
+      return;
+  }
+
+  // The harts find out who they are through mhartid (and a0), there is no
+  // such convention for the (single core) Cortex-M targets
+  unsigned hart_count = cfg_.getHarts();
+  if (hart_count > 1 && arch_ == EMU_ARCH_ARMV7) {
+    cerr << "Multiple harts are only supported for RISC-V" << endl;
+    good_ = false;
+    hart_count = 1;
+  }
+
+  /* One engine per hart, they share the memory (see init()) */
+  harts_.resize(hart_count);
+  for (auto &hart : harts_) {
+    uc_err err = uc_open(core, core_mode, &hart.uc);
+    if (err) {
+      cerr << "Failed to create uc with error" << endl;
+      good_ = false;
+      hart.uc = NULL;
+    }
+  }
+
+  /* Initialize capstone engine */
+  cs_option(cs, CS_OPT_DETAIL, CS_OPT_ON);
+
+  /* Initialize the emulator architecture, on the first hart */
+  uc = harts_[0].uc;
+  architecture.init(arch_, uc);
+}
+
+Emulator::~Emulator() {
+  for (auto device : mmio_devices_) {
+    delete device;
+  }
+
+  for (auto &hart : harts_) {
+    if (hart.uc != NULL) {
+      uc_close(hart.uc);
+    }
+  }
+  cs_close(&cs);
+}
+
+void Emulator::switchHart(unsigned id) {
+  if (uc == harts_[id].uc) {
+    return;
+  }
+
+  current_hart_ = id;
+  uc = harts_[id].uc;
+  architecture.setEngine(uc);
+}
+
+static uint32_t toUnicornProt(uint8_t permissions) {
+  uint32_t prot = UC_PROT_NONE;
+  if (permissions & Config::PERM_READ) prot |= UC_PROT_READ;
+  if (permissions & Config::PERM_WRITE) prot |= UC_PROT_WRITE;
+  if (permissions & Config::PERM_EXEC) prot |= UC_PROT_EXEC;
+  return prot;
+}
+
+/*
+ * Give the pages of the elf segments in [begin, end) of m the permissions of
+ * the segment (a page shared by segments gets all of them), the other pages
+ * are rw. Always within the permissions of the region.
+ */
+static uc_err protectElfPages(uc_engine *uc, const memseg_t &m, address_t begin,
+                              address_t end) {
+  const address_t page_size = Memory::page_size;
+
+  address_t run_begin = begin;
+  uint8_t run_permissions = 0;
+  for (address_t page = begin; page <= end; page += page_size) {
+    uint8_t permissions = 0;
+    if (page < end) {
+      for (const auto &ml : m.memload) {
+        if (ml.origin < page + page_size && ml.origin + ml.length > page) {
+          permissions |= ml.permissions;
+        }
+      }
+      if (permissions == 0) {
+        permissions = Config::PERM_READ | Config::PERM_WRITE;
+      }
+      permissions &= m.permissions;
+    }
+
+    // Protect the pages with the same permissions in one go
+    if (page == begin) {
+      run_permissions = permissions;
+    } else if (page == end || permissions != run_permissions) {
+      uc_err err = uc_mem_protect(uc, run_begin, page - run_begin,
+                                  toUnicornProt(run_permissions));
+      if (err != UC_ERR_OK) {
+        return err;
+      }
+      run_begin = page;
+      run_permissions = permissions;
+    }
+  }
+  return UC_ERR_OK;
+}
+
 bool Emulator::init() {
   if (bad()) {
     cerr << "Emulator not configured correctly" << endl;
     return false;
   }
 
-  uc_err err;
-  // Map all the memory
-  for (const auto &m : mem_.memory) {
-    // Unicorn requires the the lenght to be a multiple of 4K
-    // This is done in the Memory class and set to allocated_length
-    err = uc_mem_map_ptr(uc, m.origin, m.allocated_length, UC_PROT_ALL, m.data);
-    if (err) {
-      cerr << "Error mapping memory: " << m.name << " with error: " << err
-           << " (" << uc_strerror(err) << ")" << endl;
-      good_ = false;
+  uc_err err;
+  // Map all the memory, in every hart (the host memory is shared)
+  for (const auto &hart : harts_) {
+    for (const auto &m : mem_.memory) {
+      // Mapped on first access
+      if (m.sparse) {
+        continue;
+      }
+
+      // Unicorn requires the the lenght to be a multiple of 4K
+      // This is done in the Memory class and set to allocated_length
+      err = uc_mem_map_ptr(hart.uc, m.origin, m.allocated_length, toUnicornProt(m.permissions), m.data);
+      if (!err && m.elf_permissions) {
+        err = protectElfPages(hart.uc, m, m.origin, m.origin + m.allocated_length);
+      }
+      if (err) {
+        cerr << "Error mapping memory: " << m.name << " with error: " << err
+             << " (" << uc_strerror(err) << ")" << endl;
+        good_ = false;
+        return false;
+      }
+    }
+  }
+
+  // Keep track of what to restore on a power failure
+  for (const auto &m : mem_.memory) {
+    if (m.is_volatile) {
+      if (!mem_.startDirtyTracking()) {
+        cerr << "Power failures will restore the complete volatile memory" << endl;
+      }
+      break;
+    }
+  }
+
+  return true;
+}
+
+bool Emulator::run() {
+  if (bad()) {
+    cerr << "Emulator not initialized correctly" << endl;
+    return false;
+  }
+
+  if (!installExitPoints()) {
+    return false;
+  }
+
+  reset();
+
+  // Registers to go back to on a reset()
+  for (unsigned id = 0; id < harts_.size(); id++) {
+    switchHart(id);
+    harts_[id].boot_snapshot = snapshot(false);
+  }
+
+  // With multiple harts a slice is one quantum of a hart. The harts take
+  // turns in a fixed order, so the interleaving (and the run) is the same
+  // every time.
+  const unsigned hart_count = (unsigned)harts_.size();
+  const uint64_t max_instructions = cfg_.getMaxInstructions();
+  const uint64_t slice_instructions =
+      hart_count > 1 ? cfg_.getQuantum() : cfg_.getSliceInstructions();
+  const double time_limit = cfg_.getTimeLimit();
+  const bool idle_detection = cfg_.getIdleDetection();
+  const uint64_t idle_probe_steps = 1024;
+  // While an interrupt is pending but masked, the slices are this short so
+  // the hart takes it soon after it enables it
+  const uint64_t masked_interrupt_slice = 1000;
+  const auto start_time = chrono::steady_clock::now();
+
+  stop_requested_ = false;
+  instructions_ = 0;
+  time_ = 0;
+  waited_ = 0;
+
+  // Translated blocks only call the hooks that existed when they were
+  // translated, including the instruction count hook that unicorn adds on
+  // the first uc_emu_start() with a count. So the warm-up is done after a
+  // first slice of a single instruction (of every hart).
+  const bool warmup = cfg_.getTbWarmup() || !cfg_.getTbWarmupFile().empty();
+  for (auto &hart : harts_) {
+    hart.warmup_pending = warmup;
+    hart.waiting = false;
+    hart.idle = 0;
+    hart.idle_skip = 0;
+    hart.idle_backoff = 1;
+    hart.instructions = 0;
+  }
+
+  // Address 0 should never be executed, the run ends when it is reached
+  // (ignored when there are exit points)
+  const uint64_t emu_stop_addr = 0;
+
+  // Run in slices of instructions, this way stop requests, limits and
+  // events are handled in between slices and not for every executed
+  // instruction
+  unsigned next_hart = 0;
+  while (true) {
+    // A hook requested a restore (or reset or power failure) while the
+    // current hart ran, the slice was cut short (and counted as far as it
+    // got)
+    if (pending_restore_ != nullptr || pending_reset_ || pending_power_failure_) {
+      if (pending_power_failure_) {
+        // Also resets the CPUs, anything else pending is superseded
+        pending_power_failure_ = false;
+        pending_reset_ = false;
+        pending_restore_ = nullptr;
+        powerFailureNow();
+      } else if (pending_reset_) {
+        pending_reset_ = false;
+        pending_restore_ = nullptr;
+        resetNow();
+      } else {
+        Snapshot *snap = pending_restore_;
+        pending_restore_ = nullptr;
+        if (!restoreNow(*snap)) {
+          break;
+        }
+      }
+      pending_wait_ = false;
+      harts_[current_hart_].waiting = false;
+      harts_[current_hart_].resumed_block = false;
+    }
+
+    // The hart executed a wfi, same as above
+    if (pending_wait_) {
+      pending_wait_ = false;
+      harts_[current_hart_].resumed_block = false;
+    }
+
+    if (gStopEmulation) {
+      stop("Stop signal received");
+      break;
+    }
+
+    if (time_limit > 0) {
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+      if (elapsed.count() >= time_limit) {
+        stop("time limit reached");
+        break;
+      }
+    }
+
+    // The harts that wait for an interrupt (or idle) wake up when an event
+    // happened (it might have raised the interrupt or changed a device)
+    if (events_.runDue(time_)) {
+      for (auto &hart : harts_) {
+        hart.waiting = false;
+        hart.idle = 0;
+      }
+    }
+    if (stop_requested_) {
+      break;
+    }
+
+    // Nothing happens until the next event when all the harts wait or spin
+    // in an idle loop, jump to it instead of spinning. With multiple harts
+    // the slice before the probe might have changed what another hart's
+    // loop reads, so a hart must be idle for two slices in a row.
+    const unsigned idle_slices = hart_count > 1 ? 2 : 1;
+    bool stuck = true;
+    for (const auto &hart : harts_) {
+      if (!hart.waiting && hart.idle < idle_slices) {
+        stuck = false;
+      }
+    }
+    if (stuck) {
+      if (events_.empty()) {
+        for (unsigned i = 0; i < hart_count; i++) {
+          if (harts_[i].idle) {
+            cerr << "Hart " << i << " spins in a loop without side effects at 0x"
+                 << hex << harts_[i].idle_pc << dec << endl;
+          }
+        }
+        stop("waiting for an interrupt (or idle), but no event is pending");
+        break;
+      }
+      uint64_t next_event = events_.nextTime();
+      waited_ += next_event - time_;
+      time_ = next_event;
+      continue;
+    }
+
+    // Round-robin over the harts that don't wait
+    unsigned id = next_hart;
+    while (harts_[id].waiting) {
+      id = (id + 1) % hart_count;
+    }
+
+    next_hart = (id + 1) % hart_count;
+    switchHart(id);
+    Hart &hart = harts_[id];
+
+    // A device raised an interrupt, take it before the slice
+    bool masked_interrupt = false;
+    if (hart.pending_interrupts) {
+      masked_interrupt = !takeInterrupt();
+      if (stop_requested_) {
+        break;
+      }
+    }
+
+    // Continue where the hart was (or the entry point)
+    uint64_t emu_start_addr =
+        architecture.getStartAddress(architecture.registerGet(Architecture::REG_PC));
+
+    uint64_t count = hart.warmup_pending ? 1 : slice_instructions;
+    if (max_instructions) {
+      if (instructions_ >= max_instructions) {
+        stop("instruction limit reached");
+        break;
+      }
+      count = min(count, max_instructions - instructions_);
+    }
+
+    if (masked_interrupt) {
+      count = min(count, masked_interrupt_slice);
+    }
+
+    // Only leave the JIT when the next event is due
+    if (!events_.empty()) {
+      count = min(count, events_.nextTime() - time_);
+    }
+
+    running_ = true;
+    slice_executed_ = 0;
+    slice_count_ = count;
+    slice_cut_ = false;
+    uc_err err = uc_emu_start(uc, emu_start_addr, emu_stop_addr, 0, count);
+    running_ = false;
+    architecture.getRegisterCache().invalidate();
+
+    // Exact when the slice ran to completion. When a hook (or an exit or an
+    // error) cut it short, the blocks it entered are counted as a whole. A
+    // slice cut for an event might end in the middle of a block, the rest
+    // of the block is counted when the hart resumes.
+    const uint64_t remainder =
+        slice_cut_ ? blockRemainder(architecture.registerGet(Architecture::REG_PC)) : 0;
+    const uint64_t executed = min(slice_executed_ - remainder, count);
+    instructions_ += executed;
+    time_ += executed;
+    hart.instructions += executed;
+
+    if (err) {
+      // A hook (e.g., a protection fault) might already have said why
+      if (!stop_requested_) {
+        cerr << "Failed to start emulation with error: " << err << " ("
+             << uc_strerror(err) << ")" << endl;
+      }
+      break;
+    }
+
+    if (stop_requested_) {
+      break;
+    }
+
+    // Handled at the start of the next round
+    if (pending_restore_ != nullptr || pending_reset_ || pending_power_failure_ ||
+        pending_wait_) {
+      continue;
+    }
+
+    // Unicorn stopped at an exit point (or the slice happened to end there)
+    if (!exit_points_.empty()) {
+      auto exit = exit_points_.find(architecture.registerGet(Architecture::REG_PC));
+      if (exit != exit_points_.end()) {
+        stop(exit->second);
+        break;
+      }
+    } else if (architecture.registerGet(Architecture::REG_PC) == emu_stop_addr) {
+      // Unicorn stopped at the until address (e.g., a return to address 0),
+      // going on would restart there
+      stop("reached address 0x0");
+      break;
+    }
+
+    if (hart.warmup_pending) {
+      hart.warmup_pending = false;
+      warmupTranslationCache();
+    }
+
+    // The hart continues where the slice ended, a slice cut for an event
+    // might have ended with its last block
+    hart.resumed_block = !slice_cut_ || remainder > 0;
+
+    // A hart that ends its slices at (about) the same address might spin in
+    // an idle loop, find out with a probe. Each probe that finds a loop with
+    // side effects doubles the slices until the next probe.
+    if (idle_detection) {
+      const unsigned idle_max_backoff = 1024;
+
+      address_t pc = architecture.registerGet(Architecture::REG_PC);
+      address_t distance = pc > hart.idle_pc ? pc - hart.idle_pc : hart.idle_pc - pc;
+      hart.idle_pc = pc;
+
+      if (distance > idle_window) {
+        hart.idle = 0;
+        hart.idle_backoff = 1;
+        hart.idle_skip = 0;
+      } else if (hart.idle_skip > 0) {
+        hart.idle = 0;
+        --hart.idle_skip;
+      } else if (time_ < events_.nextTime()) {
+        // Don't step past the next event or the instruction limit
+        uint64_t steps = min(idle_probe_steps, events_.nextTime() - time_);
+        if (max_instructions) {
+          steps = min(steps, max_instructions - instructions_);
+        }
+
+        if (probeIdle(steps)) {
+          ++hart.idle;
+        } else {
+          hart.idle = 0;
+          hart.idle_backoff = min(2 * hart.idle_backoff, idle_max_backoff);
+          hart.idle_skip = hart.idle_backoff;
+        }
+      }
+    }
+  }
+
+  flushOutput();
+
+  if (hart_count > 1) {
+    for (unsigned id = 0; id < hart_count; id++) {
+      cout << "Hart " << id << ": " << harts_[id].instructions
+           << " instructions" << endl;
+    }
+  }
+
+  if (waited_) {
+    cout << "Waited for interrupts (or idle loops): skipped " << waited_
+         << " instructions of idle time" << endl;
+  }
+
+  if (warmup_blocks_) {
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+    cout << "Translation warm-up: " << warmup_blocks_ << " blocks in "
+         << warmup_time_ << "s (" << 100.0 * warmup_time_ / elapsed.count()
+         << "% of the run)" << endl;
+  }
+
+  if (profiling_) {
+    writeBlockProfile();
+  }
+
+  return true;
+}
+
+/*
+ * Translate the blocks in [begin, end), returns the number of blocks
+ */
+address_t Emulator::translateBlocks(address_t begin, address_t end) {
+  // All supported architectures have 2 byte instructions (thumb or
+  // compressed), skip that much when something is not code
+  const address_t min_instruction_size = 2;
+
+  address_t blocks = 0;
+  address_t address = begin;
+  while (address < end) {
+    uc_tb tb;
+    uc_err err = uc_ctl_request_cache(uc, address, &tb);
+    if (err != UC_ERR_OK || tb.size == 0) {
+      address += min_instruction_size;
+      continue;
+    }
+    ++blocks;
+    address += tb.size;
+  }
+  return blocks;
+}
+
+void Emulator::warmupTranslationCache() {
+  const auto start_time = chrono::steady_clock::now();
+
+  // Blocks of a previous run (--tb-profile)
+  const string &warmup_file = cfg_.getTbWarmupFile();
+  if (!warmup_file.empty()) {
+    ifstream in(warmup_file);
+    if (!in.is_open()) {
+      cerr << "Failed to open the translation warm-up file: " << warmup_file << endl;
+    }
+    address_t address;
+    while (in >> hex >> address) {
+      uc_tb tb;
+      if (uc_ctl_request_cache(uc, address, &tb) == UC_ERR_OK) {
+        ++warmup_blocks_;
+      }
+    }
+  }
+
+  // All the code in the elf file
+  if (cfg_.getTbWarmup()) {
+    for (const auto &m : mem_.memory) {
+      for (const auto &ml : m.memload) {
+        if (ml.executable) {
+          warmup_blocks_ += translateBlocks(ml.origin, ml.origin + ml.length);
+        }
+      }
+    }
+  }
+
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+  warmup_time_ = elapsed.count();
+}
+
+void Emulator::writeBlockProfile() {
+  const string &profile_file = cfg_.getTbProfileFile();
+  ofstream out(profile_file);
+  if (!out.is_open()) {
+    cerr << "Failed to open the block profile file: " << profile_file << endl;
+    return;
+  }
+
+  vector<address_t> blocks(profiled_blocks_.begin(), profiled_blocks_.end());
+  sort(blocks.begin(), blocks.end());
+  for (auto address : blocks) {
+    out << "0x" << hex << address << dec << endl;
+  }
+  cout << "Wrote " << blocks.size() << " executed blocks to: " << profile_file << endl;
+}
+
+void Emulator::addExitPoint(address_t address, string reason) {
+  exit_points_[address] = reason;
+}
+
+bool Emulator::addExitPoint(string symbol_name) {
+  const symbol_t *symbol;
+  try {
+    symbol = mem_.getSymbols().get(symbol_name);
+  } catch (...) {
+    symbol = nullptr;
+  }
+  if (symbol == nullptr) {
+    cerr << "Can not add an exit point for unknown symbol: " << symbol_name << endl;
+    return false;
+  }
+
+  addExitPoint(architecture.getFunctionAddress(symbol->address), "reached " + symbol_name);
+  return true;
+}
+
+/*
+ * Find the instructions in the executable segments that match. Instructions
+ * are (at least) 2 byte aligned, match gets the halfword at an address and
+ * the one after it (0 at the end of the segment).
+ */
+static vector<address_t> findInstructions(Memory &mem,
+                                          function<bool(uint16_t, uint16_t)> match) {
+  vector<address_t> found;
+
+  for (const auto &m : mem.memory) {
+    for (const auto &ml : m.memload) {
+      if (!ml.executable) {
+        continue;
+      }
+
+      for (address_t offset = 0; offset + 2 <= ml.length; offset += 2) {
+        uint16_t half;
+        uint16_t next = 0;
+        memcpy(&half, &ml.data[offset], sizeof(half));
+        if (offset + 4 <= ml.length) {
+          memcpy(&next, &ml.data[offset + 2], sizeof(next));
+        }
+
+        if (match(half, next)) {
+          found.push_back(ml.origin + offset);
+        }
+      }
+    }
+  }
+
+  return found;
+}
+
+size_t Emulator::addBreakpointExitPoints() {
+  vector<address_t> breakpoints;
+
+  switch (arch_) {
+    case EMU_ARCH_ARMV7:
+      breakpoints = findInstructions(mem_, [](uint16_t half, uint16_t next) {
+        (void)next;
+        return half == 0xbe00;  // bkpt #0
+      });
+      break;
+    case EMU_ARCH_RISCV32:
+    case EMU_ARCH_RISCV64:
+      breakpoints = findInstructions(mem_, [](uint16_t half, uint16_t next) {
+        return half == 0x9002 ||                    // c.ebreak
+               (half == 0x0073 && next == 0x0010);  // ebreak
+      });
+      break;
+    default:
+      break;
+  }
+
+  for (auto address : breakpoints) {
+    addExitPoint(address, "Breakpoint instruction");
+  }
+
+  return breakpoints.size();
+}
+
+bool Emulator::installExitPoints() {
+  if (exit_points_.empty()) {
+    return true;
+  }
+
+  vector<uint64_t> exits;
+  for (const auto &e : exit_points_) {
+    exits.push_back(e.first);
+  }
+
+  // NB. Unicorn checks for exits when translating, so this must be done
+  // before the first block is translated
+  for (const auto &hart : harts_) {
+    uc_err err = uc_ctl_exits_enable(hart.uc);
+    if (err == UC_ERR_OK) {
+      err = uc_ctl_set_exits(hart.uc, exits.data(), exits.size());
+    }
+    if (err != UC_ERR_OK) {
+      cerr << "Failed to set the exit points with error: " << err << " ("
+           << uc_strerror(err) << ")" << endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void Emulator::reset() {
+  // Unicorn is in the middle of an instruction, let run() handle it
+  if (running_) {
+    pending_reset_ = true;
+    uc_emu_stop(uc);
+    return;
+  }
+
+  resetNow();
+}
+
+void Emulator::resetNow() {
+  const unsigned current = current_hart_;
+
+  for (unsigned id = 0; id < harts_.size(); id++) {
+    Hart &hart = harts_[id];
+    switchHart(id);
+    hart.resumed_block = false;
+    hart.waiting = false;
+    hart.idle = 0;
+    hart.pending_interrupts = 0;
+    hart.exception_depth = 0;
+
+    if (hart.boot_snapshot.good()) {
+      restoreNow(hart.boot_snapshot);
+      continue;
+    }
+
+    // Before the run started there is no CPU state to go back to
+    architecture.registerSet(Architecture::REG_PC, getMemory().entrypoint);
+
+    // All the harts start at the entry point, like on spike they tell
+    // themselves apart by the hart id in a0 (or mhartid, see
+    // registerHartIdHooks())
+    if (harts_.size() > 1) {
+      uint64_t hartid = id;
+      uc_reg_write(uc, UC_RISCV_REG_X10, &hartid);  // a0
+      architecture.getRegisterCache().invalidate();
+    }
+  }
+  switchHart(current);
+
+  // The devices (and the interrupts they raise) start over as well
+  for (auto device : mmio_devices_) {
+    device->reset();
+  }
+  for (auto &reset : reset_callbacks_) {
+    reset();
+  }
+}
+
+void Emulator::powerFailure() {
+  // Unicorn is in the middle of an instruction, let run() handle it
+  if (running_) {
+    pending_power_failure_ = true;
+    uc_emu_stop(uc);
+    return;
+  }
+
+  powerFailureNow();
+}
+
+void Emulator::powerFailureNow() {
+  for (auto page : mem_.resetVolatile()) {
+    // Drop any code translated from the restored page
+    invalidateCode(page, page + Memory::page_size);
+  }
+
+  resetNow();
+}
+
+void Emulator::invalidateCode(address_t begin, address_t end) {
+  // Every engine has its own translation cache
+  for (const auto &hart : harts_) {
+    uc_ctl_remove_cache(hart.uc, begin, end);
+  }
+}
+
+Snapshot Emulator::snapshot(bool with_memory) {
+  Snapshot snap;
+
+  uc_err err = uc_context_alloc(uc, &snap.context);
+  if (err != UC_ERR_OK) {
+    cerr << "Failed to allocate the unicorn context with error: " << err
+         << " (" << uc_strerror(err) << ")" << endl;
+    snap.context = nullptr;
+    return snap;
+  }
+
+  err = uc_context_save(uc, snap.context);
+  if (err != UC_ERR_OK) {
+    cerr << "Failed to save the unicorn context with error: " << err
+         << " (" << uc_strerror(err) << ")" << endl;
+    uc_context_free(snap.context);
+    snap.context = nullptr;
+    return snap;
+  }
+
+  snap.pending_interrupts = harts_[current_hart_].pending_interrupts;
+  snap.exception_depth = harts_[current_hart_].exception_depth;
+
+  if (with_memory) {
+    // From here on the writes are tracked, for restore()
+    snap.write_epoch = mem_.startWriteEpoch();
+
+    snap.memory.reserve(mem_.memory.size());
+    for (const auto &m : mem_.memory) {
+      snap.memory.emplace_back(m.data, m.data + m.allocated_length);
+    }
+  }
+
+  return snap;
+}
+
+bool Emulator::restore(Snapshot &snap) {
+  if (snap.bad()) {
+    cerr << "Can not restore an invalid snapshot" << endl;
+    return false;
+  }
+
+  // Unicorn is in the middle of an instruction, stop it and let run()
+  // restore the snapshot
+  if (running_) {
+    pending_restore_ = &snap;
+    uc_emu_stop(uc);
+    return true;
+  }
+
+  return restoreNow(snap);
+}
+
+bool Emulator::restoreNow(Snapshot &snap) {
+  if (snap.hasMemory()) {
+    if (snap.memory.size() != mem_.memory.size()) {
+      cerr << "Snapshot does not match the memory layout" << endl;
+      return false;
+    }
+
+    // Only copy back the pages written since the snapshot, without write
+    // tracking the ones that differ
+    vector<pair<size_t, size_t>> pages;
+    if (snap.write_epoch != 0 && mem_.trackingDirty()) {
+      pages = mem_.writtenSince(snap.write_epoch);
+    } else {
+      for (size_t i = 0; i < mem_.memory.size(); i++) {
+        const auto &m = mem_.memory[i];
+        const uint8_t *saved = snap.memory[i].data();
+        for (size_t page = 0; page < m.allocated_length / Memory::page_size; page++) {
+          size_t offset = page * Memory::page_size;
+          if (memcmp(&m.data[offset], &saved[offset], Memory::page_size) != 0) {
+            pages.push_back(make_pair(i, page));
+          }
+        }
+      }
+    }
+
+    for (const auto &p : pages) {
+      auto &m = mem_.memory[p.first];
+      size_t offset = p.second * Memory::page_size;
+      memcpy(&m.data[offset], &snap.memory[p.first][offset], Memory::page_size);
+
+      // Unicorn does not see writes through the host pointer, drop any
+      // code it translated from this page
+      invalidateCode(m.origin + offset, m.origin + offset + Memory::page_size);
+    }
+  }
+
+  architecture.getRegisterCache().invalidate();
+
+  uc_err err = uc_context_restore(uc, snap.context);
+  if (err != UC_ERR_OK) {
+    cerr << "Failed to restore the unicorn context with error: " << err
+         << " (" << uc_strerror(err) << ")" << endl;
+    return false;
+  }
+
+  // E.g., a snapshot taken in thread mode while a handler runs
+  Hart &hart = harts_[current_hart_];
+  hart.pending_interrupts = snap.pending_interrupts;
+  hart.exception_depth = snap.exception_depth;
+
+  return true;
+}
+
+static void hook_code_cb(uc_engine *uc, uint64_t address, uint32_t size, void *user_data) {
+  (void)uc; // This should be known
+
+  // The Emulator * is the user_data
+  Emulator *emu = (Emulator *)user_data;
+  HookManager &hook_manager = emu->getHookManager();
+
+  // Build the argument struct
+  HookCode::hook_arg_t arg;
+  arg.address = (address_t)address;
+  arg.size = (address_t)size;
+  arg.registers = emu->newEventRegisters();
+  arg.hart = emu->getHartId();
+
+  hook_manager.run(address, &arg);
+
+  if (!hook_manager.hasAllEventsHooks()) {
+    return;
+  }
+
+  // Build the argument for AllEvent hooks
+  HookAllEvents::hook_arg_t e_arg;
+  e_arg.event_type = HookAllEvents::EVENT_CODE;
+  e_arg.address = (address_t)address;
+  e_arg.size = (address_t)size;
+  e_arg.registers = arg.registers;
+  e_arg.hart = arg.hart;
+
+  hook_manager.run(address, &e_arg);
+}
+
+static void hook_block_cb(uc_engine *uc, uint64_t address, uint32_t size, void *user_data) {
+  (void)uc; // This should be known
+
+  // The Emulator * is the user_data
+  Emulator *emu = (Emulator *)user_data;
+  emu->profileBlock((address_t)address);
+  address_t icount = emu->countBlock((address_t)address, (address_t)size);
+
+  // Already reported before the slice ended
+  if (emu->consumeResumedBlock() || !emu->getHookManager().hasBlockHooks()) {
+    return;
+  }
+
+  // Build the argument struct
+  HookBlock::hook_arg_t arg;
+  arg.address = (address_t)address;
+  arg.size = (address_t)size;
+  arg.icount = icount;
+  arg.registers = emu->newEventRegisters();
+  arg.hart = emu->getHartId();
+
+  emu->getHookManager().run(address, &arg);
+}
+
+static void hook_memory_cb(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
+  (void)uc; // This should be known
+
+  // The Emulator * is the user_data
+  Emulator *emu = (Emulator *)user_data;
+  HookManager &hook_manager = emu->getHookManager();
+
+  // Build the argument struct
+  HookMemory::hook_arg_t arg;
+  arg.address = (address_t)address;
+  arg.size = (address_t)size;
+  arg.value = (address_t)value;
+  arg.registers = emu->newEventRegisters();
+  arg.hart = emu->getHartId();
+
+  switch (type) {
+    case UC_MEM_READ:
+      arg.mem_type = HookMemory::MEM_READ;
+      break;
+    case UC_MEM_WRITE:
+      arg.mem_type = HookMemory::MEM_WRITE;
+      break;
+    default:
+      // TODO Handle the other cases
+      // For now we call a message and never run the hooks.
+      // Probably want to add these types to out memory class and just map them
+      // and let plugins/hooks deal with them
+      cerr << "Experienced unmpapped read or write, not implemented" << endl;
+      return;
+  }
+
+  hook_manager.run(address, &arg);
+
+  if (!hook_manager.hasAllEventsHooks()) {
+    return;
+  }
+
+  // Build the argument for AllEvent hooks
+  HookAllEvents::hook_arg_t e_arg;
+  e_arg.event_type = HookAllEvents::EVENT_MEMORY;
+  e_arg.address = (address_t)address;
+  e_arg.size = (address_t)size;
+  e_arg.value = (address_t)value;
+  e_arg.mem_type = arg.mem_type;
+  e_arg.registers = arg.registers;
+  e_arg.hart = arg.hart;
+
+  hook_manager.run(address, &e_arg);
+}
+
+static void hook_code_range_cb(uc_engine *uc, uint64_t address, uint32_t size, void *user_data) {
+  (void)uc; // This should be known
+
+  // The HookCode * is the user_data
+  HookCode *hook = (HookCode *)user_data;
+
+  HookCode::hook_arg_t arg;
+  arg.address = (address_t)address;
+  arg.size = (address_t)size;
+  arg.registers = hook->getEmulator().newEventRegisters();
+  arg.hart = hook->getEmulator().getHartId();
+
+  hook->getEmulator().getHookManager().run(hook, address, &arg);
+}
+
+static void hook_memory_range_cb(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
+  (void)uc; // This should be known
+
+  // The HookMemory * is the user_data
+  HookMemory *hook = (HookMemory *)user_data;
+
+  HookMemory::hook_arg_t arg;
+  arg.address = (address_t)address;
+  arg.size = (address_t)size;
+  arg.value = (address_t)value;
+  arg.registers = hook->getEmulator().newEventRegisters();
+  arg.hart = hook->getEmulator().getHartId();
+
+  switch (type) {
+    case UC_MEM_READ:
+      arg.mem_type = HookMemory::MEM_READ;
+      break;
+    case UC_MEM_WRITE:
+      arg.mem_type = HookMemory::MEM_WRITE;
+      break;
+    default:
+      return;
+  }
+
+  hook->getEmulator().getHookManager().run(hook, address, &arg);
+}
+
+static bool hook_memory_prot_cb(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
+  (void)uc; // This should be known
+
+  // The Emulator * is the user_data
+  Emulator *emu = (Emulator *)user_data;
+
+  const char *access;
+  switch (type) {
+    case UC_MEM_READ_PROT:
+      access = "read";
+      break;
+    case UC_MEM_WRITE_PROT:
+      access = "write";
+      break;
+    case UC_MEM_FETCH_PROT:
+      access = "fetch";
+      break;
+    default:
+      access = "access";
+      break;
+  }
+
+  memseg_t *m = emu->getMemory().find((address_t)address);
+  address_t pc = emu->getArchitecture().registerGet(Architecture::REG_PC);
+
+  cerr << "Memory protection fault: " << access << " of size " << size
+       << " at 0x" << hex << address;
+  if (type == UC_MEM_WRITE_PROT) {
+    cerr << " (value 0x" << value << ")";
+  }
+  cerr << " in " << (m ? m->name : "unknown") << " by the instruction at 0x"
+       << pc << dec;
+  if (emu->getHartCount() > 1) {
+    cerr << " on hart " << emu->getHartId();
+  }
+  cerr << endl;
+
+  emu->stop("memory protection fault");
+  return false;  // Don't continue
+}
+
+static bool hook_memory_unmapped_cb(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
+  (void)uc; // This should be known
+
+  // The Emulator * is the user_data
+  Emulator *emu = (Emulator *)user_data;
+
+  // Part of a sparse segment, map it and let unicorn retry the access
+  // (the access can cross into the next chunk, which must be mapped too)
+  if (emu->mapSparse((address_t)address) &&
+      emu->mapSparse((address_t)(address + size - 1))) {
+    return true;
+  }
+
+  const char *access;
+  switch (type) {
+    case UC_MEM_READ_UNMAPPED:
+      access = "read";
+      break;
+    case UC_MEM_WRITE_UNMAPPED:
+      access = "write";
+      break;
+    case UC_MEM_FETCH_UNMAPPED:
+      access = "fetch";
+      break;
+    default:
+      access = "access";
+      break;
+  }
+
+  address_t pc = emu->getArchitecture().registerGet(Architecture::REG_PC);
+
+  cerr << "Invalid memory access: " << access << " of size " << size
+       << " at unmapped address 0x" << hex << address;
+  if (type == UC_MEM_WRITE_UNMAPPED) {
+    cerr << " (value 0x" << value << ")";
+  }
+  cerr << " by the instruction at 0x" << pc << dec;
+  if (emu->getHartCount() > 1) {
+    cerr << " on hart " << emu->getHartId();
+  }
+  cerr << endl;
+
+  emu->stop("invalid memory access");
+  return false;  // Don't continue
+}
+
+bool Emulator::registerCodeHook() {
+  // Only pay for a callback on every instruction if someone listens
+  if (!hook_manager.hasCodeHooks() && !hook_manager.hasAllEventsHooks()) {
+    return true;
+  }
+
+  // If begin > end the hook is always called
+  const uint64_t range_code_begin = 1;
+  const uint64_t range_code_end = 0;
+
+  uc_err err = uc_hook_add(uc, &uc_hook_code, UC_HOOK_CODE, (void *)&hook_code_cb,
+                           (void *)this, range_code_begin, range_code_end);
+  if (err != UC_ERR_OK) {
+    cerr << "Failed to add the code hook with error: " << err << " ("
+         << uc_strerror(err) << ")" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool Emulator::registerBlockHook() {
+  // Always installed, the emulator counts the instructions of a slice that
+  // is cut short per block (see countBlock()). That is a callback per
+  // executed block, not per instruction.
+
+  // If begin > end the hook is always called
+  const uint64_t range_block_begin = 1;
+  const uint64_t range_block_end = 0;
+
+  uc_err err = uc_hook_add(uc, &uc_hook_block, UC_HOOK_BLOCK, (void *)&hook_block_cb,
+                           (void *)this, range_block_begin, range_block_end);
+  if (err != UC_ERR_OK) {
+    cerr << "Failed to add the block hook with error: " << err << " ("
+         << uc_strerror(err) << ")" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool Emulator::registerMemoryHook() {
+  // AllEvents hooks also receive the memory events
+  if (!hook_manager.hasMemoryHooks() && !hook_manager.hasAllEventsHooks()) {
+    return true;
+  }
+
+  // If begin > end the hook is always called
+  const uint64_t range_memory_begin = 1;
+  const uint64_t range_memory_end = 0;
+
+  // We want to hook READ and WRITE and figure it out later
+  uc_err err;
+  err = uc_hook_add(uc, &uc_hook_memory_read, UC_HOOK_MEM_READ, (void *)&hook_memory_cb,
+                    (void *)this, range_memory_begin, range_memory_end);
+  if (err != UC_ERR_OK) {
+    cerr << "Failed to add the memory read hook with error: " << err << " ("
+         << uc_strerror(err) << ")" << endl;
+    return false;
+  }
+
+  err = uc_hook_add(uc, &uc_hook_memory_write, UC_HOOK_MEM_WRITE, (void *)&hook_memory_cb,
+                    (void *)this, range_memory_begin, range_memory_end);
+  if (err != UC_ERR_OK) {
+    cerr << "Failed to add the memory write hook with error: " << err << " ("
+         << uc_strerror(err) << ")" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool Emulator::registerProtectionHook() {
+  // Only needed if some memory is protected, the hook is only called on
+  // faults so legal accesses cost nothing
+  bool protected_memory = false;
+  for (const auto &m : mem_.memory) {
+    if (m.permissions != Config::PERM_ALL || m.elf_permissions) {
+      protected_memory = true;
+    }
+  }
+  if (!protected_memory) {
+    return true;
+  }
+
+  // If begin > end the hook is always called
+  const uint64_t range_memory_begin = 1;
+  const uint64_t range_memory_end = 0;
+
+  uc_err err = uc_hook_add(uc, &uc_hook_memory_prot, UC_HOOK_MEM_PROT,
+                           (void *)&hook_memory_prot_cb, (void *)this,
+                           range_memory_begin, range_memory_end);
+  if (err != UC_ERR_OK) {
+    cerr << "Failed to add the memory protection hook with error: " << err
+         << " (" << uc_strerror(err) << ")" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool Emulator::registerUnmappedHook() {
+  // The hook is only called for unmapped accesses, so it is always
+  // installed to report the faults
+
+  // If begin > end the hook is always called
+  const uint64_t range_memory_begin = 1;
+  const uint64_t range_memory_end = 0;
+
+  uc_err err = uc_hook_add(uc, &uc_hook_memory_unmapped, UC_HOOK_MEM_UNMAPPED,
+                           (void *)&hook_memory_unmapped_cb, (void *)this,
+                           range_memory_begin, range_memory_end);
+  if (err != UC_ERR_OK) {
+    cerr << "Failed to add the unmapped memory hook with error: " << err
+         << " (" << uc_strerror(err) << ")" << endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool Emulator::mapSparse(address_t address) {
+  // Map this much at once, so a sparse segment does not end up as
+  // thousands of (single page) unicorn mappings
+  const address_t chunk_size = 16 * Memory::page_size;
+
+  memseg_t *m = mem_.find(address);
+  if (m == nullptr || !m->sparse) {
+    return false;
+  }
+
+  address_t offset = ((address - m->origin) / chunk_size) * chunk_size;
+  address_t begin = m->origin + offset;
+  address_t end = begin + min(chunk_size, (address_t)m->allocated_length - offset);
+
+  // The device windows are mapped already, the chunk stops short of them
+  for (auto device : mmio_devices_) {
+    address_t window_begin = device->getWindowBase();
+    address_t window_end = device->base + device->size;
+    window_end = ((window_end + Memory::page_size - 1) / Memory::page_size) * Memory::page_size;
+    if (address >= window_begin && address < window_end) {
+      return true;
+    }
+    if (window_end <= address && window_end > begin) {
+      begin = window_end;
+    }
+    if (window_begin > address && window_begin < end) {
+      end = window_begin;
+    }
+  }
+
+  // The host memory is already there (and reads as zero until touched),
+  // the other harts map the chunk when they access it
+  uc_err err = uc_mem_map_ptr(uc, begin, end - begin, toUnicornProt(m->permissions),
+                              &m->data[begin - m->origin]);
+  if (err == UC_ERR_MAP) {
+    // This hart mapped the chunk before (e.g., for an access that crosses
+    // into the next chunk)
+    return true;
+  }
+  if (err != UC_ERR_OK) {
+    return false;
+  }
+  if (m->elf_permissions) {
+    protectElfPages(uc, *m, begin, end);
+  }
+
+  return true;
+}
+
+static uint64_t mmio_read_cb(uc_engine *uc, uint64_t offset, unsigned size, void *user_data) {
+  (void)uc; // This should be known
+
+  // The MmioDevice * is the user_data
+  MmioDevice *device = (MmioDevice *)user_data;
+  address_t address = device->getWindowBase() + offset;
+  device->getEmulator().idleProbeRead(device, address);
+  uint64_t value = device->read(address, size);
+  device->getEmulator().cutSliceForEvents();
+  return value;
+}
+
+static void mmio_write_cb(uc_engine *uc, uint64_t offset, unsigned size, uint64_t value, void *user_data) {
+  (void)uc; // This should be known
+
+  // The MmioDevice * is the user_data
+  MmioDevice *device = (MmioDevice *)user_data;
+  device->write(device->getWindowBase() + offset, size, value);
+  device->getEmulator().cutSliceForEvents();
+}
+
+void Emulator::cutSliceForEvents() {
+  // The slice only leaves the JIT for the events that were pending when it
+  // started
+  if (running_ && !slice_cut_ && events_.nextTime() < time_ + slice_count_) {
+    slice_cut_ = true;
+    uc_emu_stop(uc);
+  }
+}
+
+// Instructions of the last block the slice entered from pc on, zero if pc
+// is not past the start of that block
+address_t Emulator::blockRemainder(address_t pc) {
+  if (pc <= block_address_ || pc >= block_address_ + block_size_) {
+    return 0;
+  }
+  return getBlockInstructionCount(pc, block_address_ + block_size_ - pc);
+}
+
+void Emulator::addMmioDevice(MmioDevice *device) {
+  mmio_devices_.push_back(device);
+}
+
+bool Emulator::mapMmioDevices() {
+  for (auto device : mmio_devices_) {
+    // Unicorn maps whole pages
+    address_t begin = device->getWindowBase();
+    address_t end = device->base + device->size;
+    end = ((end + Memory::page_size - 1) / Memory::page_size) * Memory::page_size;
+
+    // Take the window out of the memory it is part of (if any), the device
+    // passes the accesses it does not handle on to that memory
+    uc_mem_unmap(uc, begin, end - begin);
+
+    uc_err err = uc_mmio_map(uc, begin, end - begin, mmio_read_cb, (void *)device,
+                             mmio_write_cb, (void *)device);
+    if (err != UC_ERR_OK) {
+      cerr << "Failed to map the device: " << device->name << " at 0x" << hex
+           << begin << dec << " with error: " << err << " ("
+           << uc_strerror(err) << ")" << endl;
       return false;
     }
   }
 
-  // Setup all the hooks
-  registerHooks();
+  return true;
+}
+
+static void hook_wait_cb(uc_engine *uc, uint64_t address, uint32_t size, void *user_data) {
+  (void)uc; // This should be known
+
+  // The Emulator * is the user_data
+  Emulator *emu = (Emulator *)user_data;
+  emu->waitForInterrupt((address_t)address, (address_t)size);
+}
+
+void Emulator::waitForInterrupt(address_t address, address_t size) {
+  // Skip the wfi, the hart continues after it when it wakes up
+  architecture.registerSet(Architecture::REG_PC,
+                           architecture.getStartAddress(address + size));
+
+  // A pending interrupt wakes the hart right away, even a masked one
+  harts_[current_hart_].waiting = harts_[current_hart_].pending_interrupts == 0;
+  pending_wait_ = true;
+  uc_emu_stop(uc);
+}
+
+void Emulator::raiseInterrupt(unsigned hart, unsigned line) {
+  if (hart >= harts_.size() || line >= 64) {
+    cerr << "Invalid interrupt " << line << " for hart " << hart << endl;
+    return;
+  }
+
+  harts_[hart].pending_interrupts |= (uint64_t)1 << line;
+  harts_[hart].waiting = false;
+  harts_[hart].idle = 0;
+}
+
+void Emulator::clearInterrupt(unsigned hart, unsigned line) {
+  if (hart >= harts_.size() || line >= 64) {
+    cerr << "Invalid interrupt " << line << " for hart " << hart << endl;
+    return;
+  }
+
+  harts_[hart].pending_interrupts &= ~((uint64_t)1 << line);
+}
+
+// Take a pending interrupt on the current hart, false if they are masked
+bool Emulator::takeInterrupt() {
+  bool taken = arch_ == EMU_ARCH_ARMV7 ? takeArmv7Exception() : takeRiscvInterrupt();
+  architecture.getRegisterCache().invalidate();
+  if (taken) {
+    harts_[current_hart_].resumed_block = false;
+  }
+  return taken;
+}
+
+/*
+ * Trap to machine mode like the hardware does, mret is left to unicorn. The
+ * code runs in machine mode (bare metal). Unicorn does not let us set the
+ * pending bits in mip, so the handler must look at mcause.
+ */
+bool Emulator::takeRiscvInterrupt() {
+  const uint64_t mstatus_mie = 1 << 3;
+  const uint64_t mstatus_mpie = 1 << 7;
+  const uint64_t mstatus_mpp = 3 << 11;
+
+  uint64_t mstatus = 0, mie = 0, mtvec = 0;
+  uc_reg_read(uc, UC_RISCV_REG_MSTATUS, &mstatus);
+  uc_reg_read(uc, UC_RISCV_REG_MIE, &mie);
+  uint64_t enabled = harts_[current_hart_].pending_interrupts & mie;
+  if (!(mstatus & mstatus_mie) || enabled == 0) {
+    return false;
+  }
+
+  // External, software, timer (machine before supervisor)
+  static const unsigned priority[] = {11, 3, 7, 9, 1, 5};
+  unsigned cause = 64;
+  for (auto p : priority) {
+    if (enabled & ((uint64_t)1 << p)) {
+      cause = p;
+      break;
+    }
+  }
+  if (cause == 64) {
+    return false;
+  }
+
+  const unsigned xlen = arch_ == EMU_ARCH_RISCV32 ? 32 : 64;
+  uint64_t mepc = architecture.registerGet(Architecture::REG_PC);
+  uint64_t mcause = ((uint64_t)1 << (xlen - 1)) | cause;
+  mstatus = (mstatus & ~(mstatus_mie | mstatus_mpie)) | mstatus_mpie | mstatus_mpp;
+  uc_reg_read(uc, UC_RISCV_REG_MTVEC, &mtvec);
+  uint64_t pc = (mtvec & ~(uint64_t)3) + ((mtvec & 1) ? 4 * cause : 0);
 
+  uc_reg_write(uc, UC_RISCV_REG_MEPC, &mepc);
+  uc_reg_write(uc, UC_RISCV_REG_MCAUSE, &mcause);
+  uc_reg_write(uc, UC_RISCV_REG_MSTATUS, &mstatus);
+  architecture.registerSet(Architecture::REG_PC, pc);
   return true;
 }
 
-bool Emulator::run() {
-  if (bad()) {
-    cerr << "Emulator not initialized correctly" << endl;
+/*
+ * Exception entry like a Cortex-M does: stack the caller saved registers and
+ * branch to the handler in the vector table with an EXC_RETURN value in lr.
+ * Unicorn has no NVIC, so there are no priorities: the lowest exception
+ * number goes first and a handler is never preempted.
+ */
+bool Emulator::takeArmv7Exception() {
+  const address_t vtor_address = 0xE000ED08;
+  const uint32_t exc_return_thread_msp = 0xFFFFFFF9;
+
+  Hart &hart = harts_[current_hart_];
+  uint32_t primask = 0;
+  uc_reg_read(uc, UC_ARM_REG_PRIMASK, &primask);
+  if (hart.exception_depth > 0 || (primask & 1)) {
     return false;
   }
 
-  reset();
+  unsigned exception = 0;
+  while (!(hart.pending_interrupts & ((uint64_t)1 << exception))) {
+    ++exception;
+  }
+  hart.pending_interrupts &= ~((uint64_t)1 << exception);
 
-  //const uint64_t emu_start_addr = getMemory().entrypoint | 1;
-  const uint64_t emu_start_addr = getMemory().entrypoint;
-  const uint64_t emu_stop_addr = 0; // Address 0 should never be executed, so run forever
-  uc_err err = uc_emu_start(uc, emu_start_addr, emu_stop_addr, 0, 0);
-  if (err) {
-    cerr << "Failed to start emulation with error: " << err << " ("
-         << uc_strerror(err) << ")" << endl;
+  ArchitectureArmv7 &arm = architecture.getArmv7Architecture();
+  const ArchitectureArmv7::Register stacked[] = {
+      ArchitectureArmv7::REG_R0, ArchitectureArmv7::REG_R1,
+      ArchitectureArmv7::REG_R2, ArchitectureArmv7::REG_R3,
+      ArchitectureArmv7::REG_R12, ArchitectureArmv7::REG_LR,
+      ArchitectureArmv7::REG_PC};
+  uint32_t frame[8] = {0};
+  arm.registerGet(stacked, frame, 7);
+  frame[6] &= ~1u;  // Return address
+  uc_reg_read(uc, UC_ARM_REG_XPSR, &frame[7]);
+
+  // The frame is 8 byte aligned, bit 9 of the stacked xPSR tells
+  uint32_t sp = arm.registerGet(ArchitectureArmv7::REG_SP);
+  if (sp & 4) {
+    frame[7] |= 1 << 9;
   }
+  sp = (sp - sizeof(frame)) & ~7u;
 
+  uint32_t vtor = 0, handler = 0;
+  mem_view_.read(vtor_address, &vtor, sizeof(vtor));
+  if (!mem_view_.write(sp, frame, sizeof(frame)) ||
+      !mem_view_.read(vtor + 4 * exception, &handler, sizeof(handler))) {
+    cerr << "Failed to enter exception " << exception << " (stack at 0x" << hex
+         << sp << ", vector table at 0x" << vtor << dec << ")" << endl;
+    stop("invalid exception entry");
+    return false;
+  }
+
+  arm.registerSet(ArchitectureArmv7::REG_SP, sp);
+  arm.registerSet(ArchitectureArmv7::REG_LR, exc_return_thread_msp);
+  arm.registerSet(ArchitectureArmv7::REG_PC, handler);
+  ++hart.exception_depth;
   return true;
 }
 
-void Emulator::reset() {
-  architecture.registerSet(Architecture::REG_PC, getMemory().entrypoint);
+/*
+ * The handler branched to the EXC_RETURN value. Unicorn does not know it
+ * runs a handler (see takeArmv7Exception()), so the fetch from there is a
+ * prefetch abort (the default memory map of the Cortex-M does not execute
+ * from the system region). Pop the frame and continue at the stacked return
+ * address, unicorn goes on at the PC the interrupt hook set, so the slice
+ * is not cut short.
+ */
+bool Emulator::exceptionReturn(uint32_t intno, address_t address) {
+  const uint32_t excp_prefetch_abort = 3;  // Exception number in unicorn
+  const address_t exc_return_begin = 0xFFFFFFE0;
+
+  if (arch_ != EMU_ARCH_ARMV7 || intno != excp_prefetch_abort ||
+      address < exc_return_begin) {
+    return false;
+  }
+
+  Hart &hart = harts_[current_hart_];
+  if (hart.exception_depth == 0) {
+    cerr << "Branch to 0x" << hex << address << dec << " outside of an exception handler"
+         << endl;
+    stop("invalid exception return");
+    return true;
+  }
+
+  ArchitectureArmv7 &arm = architecture.getArmv7Architecture();
+  uint32_t sp = arm.registerGet(ArchitectureArmv7::REG_SP);
+  uint32_t frame[8];
+  if (!mem_view_.read(sp, frame, sizeof(frame))) {
+    cerr << "Failed to return from an exception (stack at 0x" << hex << sp
+         << dec << ")" << endl;
+    stop("invalid exception return");
+    return true;
+  }
+
+  const ArchitectureArmv7::Register stacked[] = {
+      ArchitectureArmv7::REG_R0, ArchitectureArmv7::REG_R1,
+      ArchitectureArmv7::REG_R2, ArchitectureArmv7::REG_R3,
+      ArchitectureArmv7::REG_R12, ArchitectureArmv7::REG_LR,
+      ArchitectureArmv7::REG_PC};
+  // Back to Thumb
+  frame[6] = architecture.getStartAddress(frame[6]);
+  arm.registerSet(stacked, frame, 7);
+  // Only the flags, the rest of the xPSR did not change
+  arm.registerSet(ArchitectureArmv7::REG_APSR, frame[7] & 0xF80F0000);
+  sp += sizeof(frame) + ((frame[7] & (1 << 9)) ? 4 : 0);
+  arm.registerSet(ArchitectureArmv7::REG_SP, sp);
+
+  --hart.exception_depth;
+  return true;
 }
 
-static void hook_code_cb(uc_engine *uc, uint64_t address, uint32_t size, void *user_data) {
+static void hook_idle_write_cb(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
   (void)uc; // This should be known
+  (void)type;
 
   // The Emulator * is the user_data
   Emulator *emu = (Emulator *)user_data;
-  HookManager &hook_manager = emu->getHookManager();
+  emu->idleProbeWrite((address_t)address, (address_t)size, (uint64_t)value);
+}
 
-  // Build the argument struct
-  HookCode::hook_arg_t arg;
-  arg.address = (address_t)address;
-  arg.size = (address_t)size;
+void Emulator::idleProbeWrite(address_t address, address_t size, uint64_t value) {
+  // Writing what is already there changes nothing, a device might do
+  // anything with a write
+  uint64_t current = 0;
+  if (size > sizeof(current) || isMmio(address) ||
+      !mem_view_.read(address, &current, size) ||
+      memcmp(&current, &value, size) != 0) {
+    idle_side_effect_ = true;
+  }
+}
 
-  hook_manager.run(address, &arg);
+void Emulator::idleProbeRead(MmioDevice *device, address_t address) {
+  // A loop that polls a register that changes with the time (e.g., a timer
+  // count) ends by itself
+  if (probing_ && device->readDependsOnTime(address)) {
+    idle_side_effect_ = true;
+  }
+}
 
-  // Build the argument for AllEvent hooks
-  HookAllEvents::hook_arg_t e_arg;
-  e_arg.event_type = HookAllEvents::EVENT_CODE;
-  e_arg.address = (address_t)address;
-  e_arg.size = (address_t)size;
+bool Emulator::isMmio(address_t address) {
+  for (auto device : mmio_devices_) {
+    address_t end = device->base + device->size;
+    end = ((end + Memory::page_size - 1) / Memory::page_size) * Memory::page_size;
+    if (address >= device->getWindowBase() && address < end) {
+      return true;
+    }
+  }
+  return false;
+}
 
-  hook_manager.run(address, &e_arg);
+/*
+ * Step the current hart (at most max_steps instructions) to find out if it
+ * spins in an idle loop: it comes back to where it started with the same
+ * registers, did not write anything that changes the memory or a device and
+ * did not read a device register that changes with the time. Such a loop
+ * only ends when something else (an event or another hart) changes the
+ * memory or a device it reads. The probe gives up when the hart leaves the
+ * idle_window around where it started. The steps count as executed
+ * instructions.
+ *
+ * NB. The block hooks don't see the blocks the probe steps through.
+ */
+bool Emulator::probeIdle(uint64_t max_steps) {
+  RegisterCache &registers = architecture.getRegisterCache();
+  registers.invalidate();
+  const vector<address_t> start = registers.getAll();
+  const address_t start_pc = architecture.registerGet(Architecture::REG_PC);
+
+  // Translated blocks only call the hooks that existed when they were
+  // translated, so translate the window again with the write hook (and
+  // after the probe without it)
+  const address_t window_begin = start_pc > idle_window ? start_pc - idle_window : 0;
+  const address_t window_end = start_pc + idle_window;
+  uc_ctl_remove_cache(uc, window_begin, window_end);
+
+  // If begin > end the hook is always called
+  uc_hook hh;
+  uc_err err = uc_hook_add(uc, &hh, UC_HOOK_MEM_WRITE, (void *)&hook_idle_write_cb,
+                           (void *)this, 1, 0);
+  if (err != UC_ERR_OK) {
+    cerr << "Failed to add the idle probe hook with error: " << err << " ("
+         << uc_strerror(err) << ")" << endl;
+    return false;
+  }
+
+  Hart &hart = harts_[current_hart_];
+  bool idle = false;
+  idle_side_effect_ = false;
+  probing_ = true;
+
+  for (uint64_t step = 0; step < max_steps; step++) {
+    address_t pc = architecture.registerGet(Architecture::REG_PC);
+
+    // Every step starts a new block, which is not a new block for the hooks
+    hart.resumed_block = true;
+    running_ = true;
+    slice_executed_ = 0;
+    slice_count_ = 1;
+    slice_cut_ = false;
+    err = uc_emu_start(uc, architecture.getStartAddress(pc), 0, 0, 1);
+    running_ = false;
+    registers.invalidate();
+
+    // The steps are exact, so devices see the time go on (e.g., a loop that
+    // polls a timer is not idle)
+    const uint64_t executed = min(slice_executed_, (uint64_t)1);
+    instructions_ += executed;
+    time_ += executed;
+    hart.instructions += executed;
+
+    // A hook cut the step short
+    if (err != UC_ERR_OK || stop_requested_ || pending_restore_ != nullptr ||
+        pending_reset_ || pending_power_failure_ || pending_wait_) {
+      break;
+    }
+
+    pc = architecture.registerGet(Architecture::REG_PC);
+    if (idle_side_effect_ || exit_points_.count(pc) || pc < window_begin ||
+        pc >= window_end) {
+      break;
+    }
+
+    if (pc == start_pc) {
+      idle = (registers.getAll() == start);
+      break;
+    }
+  }
+  hart.resumed_block = true;
+  probing_ = false;
+
+  uc_hook_del(uc, hh);
+  uc_ctl_remove_cache(uc, window_begin, window_end);
+
+  return idle;
 }
 
-static void hook_memory_cb(uc_engine *uc, uc_mem_type type, uint64_t address, int size, int64_t value, void *user_data) {
+bool Emulator::registerWaitHooks() {
+  vector<address_t> waits;
+
+  switch (arch_) {
+    case EMU_ARCH_ARMV7:
+      waits = findInstructions(mem_, [](uint16_t half, uint16_t next) {
+        return half == 0xbf30 ||                    // wfi
+               (half == 0xf3af && next == 0x8003);  // wfi.w
+      });
+      break;
+    case EMU_ARCH_RISCV32:
+    case EMU_ARCH_RISCV64:
+      waits = findInstructions(mem_, [](uint16_t half, uint16_t next) {
+        return half == 0x0073 && next == 0x1050;  // wfi
+      });
+      break;
+    default:
+      break;
+  }
+
+  // Like the range hooks, unicorn only calls out when a wfi is executed
+  for (auto address : waits) {
+    uc_hook hh;
+    uc_err err = uc_hook_add(uc, &hh, UC_HOOK_CODE, (void *)&hook_wait_cb,
+                             (void *)this, address, address);
+    if (err != UC_ERR_OK) {
+      cerr << "Failed to add the wait for interrupt hook at 0x" << hex
+           << address << dec << " with error: " << err << " ("
+           << uc_strerror(err) << ")" << endl;
+      return false;
+    }
+    uc_hooks_range.push_back(hh);
+  }
+
+  return true;
+}
+
+static void hook_hart_id_cb(uc_engine *uc, uint64_t address, uint32_t size, void *user_data) {
   (void)uc; // This should be known
+  (void)size;
 
   // The Emulator * is the user_data
   Emulator *emu = (Emulator *)user_data;
-  HookManager &hook_manager = emu->getHookManager();
+  emu->readHartId((address_t)address);
+}
 
-  // Build the argument struct
-  HookMemory::hook_arg_t arg;
-  arg.address = (address_t)address;
-  arg.size = (address_t)size;
-  arg.value = (address_t)value;
+void Emulator::readHartId(address_t address) {
+  uint32_t instruction = 0;
+  if (!mem_view_.load(address, instruction)) {
+    return;
+  }
 
-  switch (type) {
-    case UC_MEM_READ:
-      arg.mem_type = HookMemory::MEM_READ;
-      break;
-    case UC_MEM_WRITE:
-      arg.mem_type = HookMemory::MEM_WRITE;
-      break;
-    default:
-      // TODO Handle the other cases
-      // For now we call a message and never run the hooks.
-      // Probably want to add these types to out memory class and just map them
-      // and let plugins/hooks deal with them
-      cerr << "Experienced unmpapped read or write, not implemented" << endl;
-      return;
+  // Every unicorn engine is a single CPU with mhartid 0, the hart id goes
+  // to rd instead and the csrr is skipped
+  unsigned rd = (instruction >> 7) & 0x1f;
+  if (rd != 0) {
+    uint64_t hartid = current_hart_;
+    uc_reg_write(uc, UC_RISCV_REG_X0 + rd, &hartid);
   }
+  architecture.registerSet(Architecture::REG_PC, address + 4);
+  architecture.getRegisterCache().invalidate();
+}
 
-  hook_manager.run(address, &arg);
+bool Emulator::registerHartIdHooks() {
+  if (arch_ != EMU_ARCH_RISCV32 && arch_ != EMU_ARCH_RISCV64) {
+    return true;
+  }
 
-  // Build the argument for AllEvent hooks
-  HookAllEvents::hook_arg_t e_arg;
-  e_arg.event_type = HookAllEvents::EVENT_MEMORY;
-  e_arg.address = (address_t)address;
-  e_arg.size = (address_t)size;
-  e_arg.value = (address_t)value;
-  e_arg.mem_type = arg.mem_type;
+  vector<address_t> reads = findInstructions(mem_, [](uint16_t half, uint16_t next) {
+    return (half & 0xf07f) == 0x2073 && next == 0xf140;  // csrr rd, mhartid
+  });
 
-  hook_manager.run(address, &e_arg);
+  // Like the wait hooks, unicorn only calls out when mhartid is read
+  for (auto address : reads) {
+    uc_hook hh;
+    uc_err err = uc_hook_add(uc, &hh, UC_HOOK_CODE, (void *)&hook_hart_id_cb,
+                             (void *)this, address, address);
+    if (err != UC_ERR_OK) {
+      cerr << "Failed to add the mhartid hook at 0x" << hex << address << dec
+           << " with error: " << err << " (" << uc_strerror(err) << ")" << endl;
+      return false;
+    }
+    uc_hooks_range.push_back(hh);
+  }
+
+  return true;
 }
 
-bool Emulator::registerCodeHook() {
+static void hook_interrupt_cb(uc_engine *uc, uint32_t intno, void *user_data) {
+  (void)uc; // This should be known
 
-  // If begin > end the hook is always called
-  const uint64_t range_code_begin = 1;
-  const uint64_t range_code_end = 0;
+  // The Emulator * is the user_data
+  Emulator *emu = (Emulator *)user_data;
+  address_t pc = emu->getArchitecture().registerGet(Architecture::REG_PC);
+
+  // A Cortex-M exception handler returns
+  if (emu->exceptionReturn(intno, pc)) {
+    return;
+  }
+
+  // Build the argument struct
+  HookInterrupt::hook_arg_t arg;
+  arg.registers = emu->newEventRegisters();
+  arg.address = pc;
+  arg.size = 0;
+  arg.intno = intno;
+  arg.hart = emu->getHartId();
 
-  uc_hook_add(uc, &uc_hook_code, UC_HOOK_CODE, (void *)&hook_code_cb,
-              (void *)this, range_code_begin, range_code_end);
+  emu->getHookManager().run(arg.address, &arg);
 
-  return true; // TODO
+  // Unicorn would continue at the trapping instruction
+  if (!arg.handled) {
+    cerr << "Unhandled exception " << intno << " at 0x" << hex << arg.address << dec;
+    if (emu->getHartCount() > 1) {
+      cerr << " on hart " << emu->getHartId();
+    }
+    cerr << endl;
+    emu->stop("unhandled exception");
+  }
 }
 
-bool Emulator::registerMemoryHook() {
+bool Emulator::registerInterruptHook() {
+  // Without the hook unicorn stops with UC_ERR_EXCEPTION, a Cortex-M always
+  // needs it to return from exception handlers (see exceptionReturn())
+  if (!hook_manager.hasInterruptHooks() && arch_ != EMU_ARCH_ARMV7) {
+    return true;
+  }
 
-  // If begin > end the hook is always called
-  const uint64_t range_memory_begin = 1;
-  const uint64_t range_memory_end = 0;
+  uc_err err = uc_hook_add(uc, &uc_hook_interrupt, UC_HOOK_INTR, (void *)&hook_interrupt_cb,
+                           (void *)this, 1, 0);
+  if (err != UC_ERR_OK) {
+    cerr << "Failed to add the interrupt hook with error: " << err << " ("
+         << uc_strerror(err) << ")" << endl;
+    return false;
+  }
 
-  // We want to hook READ and WRITE and figure it out later
-  uc_hook_add(uc, &uc_hook_memory, UC_HOOK_MEM_READ, (void *)&hook_memory_cb,
-              (void *)this, range_memory_begin, range_memory_end);
+  return true;
+}
+
+void Emulator::addFlushCallback(function<void()> callback) {
+  flush_callbacks_.push_back(callback);
+}
+
+void Emulator::addResetCallback(function<void()> callback) {
+  reset_callbacks_.push_back(callback);
+}
+
+void Emulator::flushOutput() {
+  for (auto &flush : flush_callbacks_) {
+    flush();
+  }
+}
 
-  uc_hook_add(uc, &uc_hook_memory, UC_HOOK_MEM_WRITE, (void *)&hook_memory_cb,
-              (void *)this, range_memory_begin, range_memory_end);
+bool Emulator::registerRangeHooks() {
+  uc_err err;
+
+  // Every range hook gets its own unicorn hook, so unicorn only calls out
+  // when the range is executed or accessed
+  for (auto hook : hook_manager.getCodeRangeHooks()) {
+    uc_hook hh;
+    err = uc_hook_add(uc, &hh, UC_HOOK_CODE, (void *)&hook_code_range_cb,
+                      (void *)hook, hook->low, hook->high);
+    if (err != UC_ERR_OK) {
+      cerr << "Failed to add the code range hook: " << hook->name
+           << " with error: " << err << " (" << uc_strerror(err) << ")" << endl;
+      return false;
+    }
+    uc_hooks_range.push_back(hh);
+  }
+
+  for (auto hook : hook_manager.getMemoryRangeHooks()) {
+    uc_hook hh;
+    err = uc_hook_add(uc, &hh, UC_HOOK_MEM_READ | UC_HOOK_MEM_WRITE,
+                      (void *)&hook_memory_range_cb, (void *)hook, hook->low,
+                      hook->high);
+    if (err != UC_ERR_OK) {
+      cerr << "Failed to add the memory range hook: " << hook->name
+           << " with error: " << err << " (" << uc_strerror(err) << ")" << endl;
+      return false;
+    }
+    uc_hooks_range.push_back(hh);
+  }
 
-  return true; // TODO
+  return true;
 }
 
 bool Emulator::registerHooks() {
+  if (bad()) {
+    cerr << "Emulator not initialized correctly" << endl;
+    return false;
+  }
+
+  profiling_ = !cfg_.getTbProfileFile().empty();
+
+  // Every hart gets the same hooks and devices
+  bool ok = true;
+  for (unsigned id = 0; id < harts_.size() && ok; id++) {
+    switchHart(id);
+    ok = registerCodeHook() && registerBlockHook() && registerMemoryHook() &&
+         registerProtectionHook() && registerUnmappedHook() &&
+         registerRangeHooks() && registerWaitHooks() && registerHartIdHooks() &&
+         registerInterruptHook() && mapMmioDevices();
+  }
+  switchHart(0);
 
-  registerCodeHook();
-  registerMemoryHook();
+  if (!ok) {
+    good_ = false;
+    return false;
+  }
 
   return true;
 }
 
 void Emulator::stop(string reason) {
+  flushOutput();
   cout << "Stopping the emulator, reason: " << reason << endl;
+  stop_requested_ = true;
   uc_err err = uc_emu_stop(uc);
 
   if (err != UC_ERR_OK) {
@@ -182,6 +1921,50 @@ bool Emulator::readMemory(address_t address, char *result, address_t size)
   return true;
 }
 
+address_t Emulator::getBlockInstructionCount(address_t address, address_t size) {
+  // Blocks are executed many more times than they are translated, so only
+  // disassemble a block the first time we see it
+  auto cached = block_icount_cache.find(address);
+  if (cached != block_icount_cache.end() && cached->second.first == size) {
+    return cached->second.second;
+  }
+
+  address_t icount = 0;
+  vector<uint8_t> code;
+  const uint8_t *code_ptr = nullptr;
+  MemorySpan code_span = mem_view_.span(address, size);
+  if (code_span) {
+    code_ptr = code_span.data();
+  } else {
+    // The block crosses segments (or is not backed by host memory)
+    code.resize(size);
+    if (readMemory(address, (char *)code.data(), size)) {
+      code_ptr = code.data();
+    }
+  }
+
+  if (code_ptr != nullptr) {
+    size_t code_size = size;
+    uint64_t code_address = address;
+
+    cs_insn *insn = cs_malloc(cs);
+    while (cs_disasm_iter(cs, &code_ptr, &code_size, &code_address, insn)) {
+      ++icount;
+    }
+    cs_free(insn, 1);
+  }
+
+  // Unicorn does not hand out empty blocks
+  if (icount == 0) {
+    cerr << "Failed to disassemble the block at address: 0x" << hex << address
+         << dec << " size: " << size << endl;
+    icount = 1;
+  }
+
+  block_icount_cache[address] = make_pair(size, icount);
+  return icount;
+}
+
 string Emulator::getElfDir() {
   auto elf_file = getElfFile();
   auto last_slash = elf_file.find_last_of("\\/");
@@ -1,10 +1,16 @@
+#include <csignal>
 #include <cstdint>
 #include <cstring>
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include "elfio/elfio.hpp"
+#include "elfio/elf_types.hpp"
 
 #include "icemu/emu/types.h"
 #include "icemu/emu/Memory.h"
@@ -45,6 +51,144 @@ size_t Memory::map_segment_to_memory(address_t *origin, address_t *length) {
   return i;
 }
 
+/*
+ * Map the elf file read-only, the segment data is copied straight from the
+ * mapping into the memory segments
+ */
+bool Memory::mapElf() {
+  int fd = open(elf_file_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)EI_NIDENT) {
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  // Kept open to map page aligned segments copy-on-write in populate()
+  elf_fd_ = fd;
+  elf_data_ = (const uint8_t *)data;
+  elf_size_ = st.st_size;
+  return true;
+}
+
+// True if [offset, offset + size) is inside the elf file
+bool Memory::inElf(uint64_t offset, uint64_t size) {
+  return offset <= elf_size_ && size <= elf_size_ - offset;
+}
+
+template <typename Ehdr, typename Phdr, typename Shdr, typename Sym>
+bool Memory::collectElf() {
+  const Ehdr *ehdr = (const Ehdr *)elf_data_;
+  if (!inElf(0, sizeof(Ehdr))) {
+    return false;
+  }
+
+  /* Get the entry point */
+  entrypoint = ehdr->e_entry;
+
+  /* Get the loadable segments */
+  if (!inElf(ehdr->e_phoff, (uint64_t)ehdr->e_phnum * sizeof(Phdr))) {
+    return false;
+  }
+  const Phdr *phdrs = (const Phdr *)&elf_data_[ehdr->e_phoff];
+  for (size_t i = 0; i < ehdr->e_phnum; i++) {
+    const Phdr *pseg = &phdrs[i];
+
+    address_t seg_origin = pseg->p_paddr;
+    address_t seg_length = pseg->p_filesz;
+
+    if (seg_length == 0) {
+      continue;
+    }
+
+    if (!inElf(pseg->p_offset, pseg->p_filesz)) {
+      return false;
+    }
+
+    // Map the segment to fit in one of the allocated memory segments
+    size_t mem_idx = map_segment_to_memory(&seg_origin, &seg_length);
+    if (mem_idx < memory.size()) {
+      // We might have skipped garbage by reducing the length, so
+      // we need to calculate the offset
+      address_t offset = seg_origin - pseg->p_paddr;
+
+      // Now add the data to load to the memory memload vector, the data
+      // points into the elf mapping
+      memload_t mload;
+      mload.origin = seg_origin;
+      mload.length = seg_length;
+      mload.data = &elf_data_[pseg->p_offset + offset];
+      mload.executable = (pseg->p_flags & PF_X) != 0;
+      mload.permissions = ((pseg->p_flags & PF_R) ? Config::PERM_READ : 0) |
+                          ((pseg->p_flags & PF_W) ? Config::PERM_WRITE : 0) |
+                          ((pseg->p_flags & PF_X) ? Config::PERM_EXEC : 0);
+
+      // Push the mload to the correct memory entry
+      memory.at(mem_idx).memload.push_back(mload);
+    }
+  }
+
+  // Build a map for the symbols (aka the symbol table)
+  if (!inElf(ehdr->e_shoff, (uint64_t)ehdr->e_shnum * sizeof(Shdr))) {
+    return false;
+  }
+  const Shdr *shdrs = (const Shdr *)&elf_data_[ehdr->e_shoff];
+  for (size_t i = 0; i < ehdr->e_shnum; i++) {
+    const Shdr *psec = &shdrs[i];
+    if (psec->sh_type != SHT_SYMTAB && psec->sh_type != SHT_DYNSYM) {
+      continue;
+    }
+
+    // The names are in the linked string table
+    if (psec->sh_link >= ehdr->e_shnum) {
+      return false;
+    }
+    const Shdr *pstr = &shdrs[psec->sh_link];
+    if (!inElf(psec->sh_offset, psec->sh_size) ||
+        !inElf(pstr->sh_offset, pstr->sh_size)) {
+      return false;
+    }
+    const char *strtab = (const char *)&elf_data_[pstr->sh_offset];
+
+    const Sym *syms = (const Sym *)&elf_data_[psec->sh_offset];
+    size_t sym_num = psec->sh_size / sizeof(Sym);
+    for (size_t j = 0; j < sym_num; j++) {
+      const Sym *sym = &syms[j];
+      if (sym->st_name >= pstr->sh_size) {
+        continue;
+      }
+
+      // Only add the symbol if we can actually find it later
+      // i.e. if it has a name
+      std::string name(&strtab[sym->st_name],
+                       strnlen(&strtab[sym->st_name], pstr->sh_size - sym->st_name));
+      if (name.length()) {
+        symbol_t symb;
+        symb.address = sym->st_value;
+        symb.size = sym->st_size;
+        symb.bind = ELF_ST_BIND(sym->st_info);
+        symb.type = ELF_ST_TYPE(sym->st_info);
+        symb.section = sym->st_shndx;
+        symb.other = sym->st_other;
+        symb.name = name;
+
+        symbols.add(symb);
+      }
+    }
+  }
+
+  return true;
+}
+
 /*
  * Collect the sections and init fields from the elf file
  * and the config
@@ -56,34 +200,43 @@ bool Memory::collect() {
     memseg.name = mr.name;
     memseg.origin = mr.origin;
     memseg.length = mr.length;
+    memseg.permissions = mr.permissions;
+    memseg.sparse = mr.sparse;
+    memseg.elf_permissions = mr.elf_permissions;
+    memseg.is_volatile = mr.is_volatile;
+    memseg.huge_pages = mr.huge_pages;
+    memseg.file = mr.file;
 
     memory.push_back(memseg);
   }
 
   /* Get the corresponding memory segments to fill/load from the elf file */
-  if (!elf_reader.load(elf_file_)) {
+  if (!mapElf() || !inElf(0, sizeof(Elf32_Ehdr)) || elf_data_[0] != ELFMAG0 ||
+      elf_data_[1] != 'E' || elf_data_[2] != 'L' || elf_data_[3] != 'F') {
     cerr << "Error reading elf file " << elf_file_ << endl;
     return false;
   }
 
-  /* Get the entry point */
-  entrypoint = elf_reader.get_entry();
-
   /* Get the architecture */
   /* https://en.wikipedia.org/wiki/Executable_and_Linkable_Format */
-  unsigned char e_machine = elf_reader.get_machine();
-  unsigned char e_class = elf_reader.get_class();
+  unsigned char e_class = elf_data_[EI_CLASS];
+  Elf_Half e_machine;
+  if (e_class == ELFCLASS64) {
+    e_machine = ((const Elf64_Ehdr *)elf_data_)->e_machine;
+  } else {
+    e_machine = ((const Elf32_Ehdr *)elf_data_)->e_machine;
+  }
 
   // ARMv7 32-bit
-  if (e_machine == 0x28 && e_class == 1) {
+  if (e_machine == EM_ARM && e_class == ELFCLASS32) {
     elf_arch = Arch::EMU_ARCH_ARMV7;
-  } 
+  }
   // RISCV 32-bit
-  else if (e_machine == 0xF3 && e_class == 1) {
+  else if (e_machine == EM_RISCV && e_class == ELFCLASS32) {
     elf_arch = Arch::EMU_ARCH_RISCV32;
   }
   // RISCV 64-bit
-  else if (e_machine == 0xF3 && e_class == 2) {
+  else if (e_machine == EM_RISCV && e_class == ELFCLASS64) {
     elf_arch = Arch::EMU_ARCH_RISCV64;
   }
   // Unknown
@@ -94,89 +247,24 @@ bool Memory::collect() {
     assert(false);
   }
 
-  size_t seg_num = elf_reader.segments.size();
-  for (size_t i = 0; i < seg_num; i++) {
-    const segment *pseg = elf_reader.segments[i];
-
-    address_t seg_origin = pseg->get_physical_address();
-    address_t seg_length = pseg->get_file_size();
-
-    if (seg_length == 0) {
-      continue;
-    }
-
-#if 0
-        cout << "Mapping Segment: " << i
-            << " Origin: "
-            << seg_origin
-            << " Length: "
-            << seg_length
-            << endl;
-#endif
-
-    // Map the segment to fit in one of the allocated memory segments
-    size_t mem_idx = map_segment_to_memory(&seg_origin, &seg_length);
-    if (mem_idx < memory.size()) {
-      // cout << "Mapped: " << seg_origin << " len: " << seg_length << endl;
-
-      // Now add the data to load to the memory memload vevtor
-      memload_t mload;
-      mload.origin = seg_origin;
-      mload.length = seg_length;
-      mload.data = new uint8_t[mload.length];
-
-      // We might have skipped garbage by reducing the length, so
-      // we need to calculate the offset
-      address_t offset = seg_origin - pseg->get_physical_address();
-
-      // Copy the data
-      memcpy(mload.data, &pseg->get_data()[offset], mload.length);
-
-      // Push the mload to the correct memory entry
-      memory.at(mem_idx).memload.push_back(mload);
-    }
+  // All supported targets are little endian, so the headers can be read
+  // in place
+  bool ok;
+  if (e_class == ELFCLASS64) {
+    ok = collectElf<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Sym>();
+  } else {
+    ok = collectElf<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Sym>();
   }
-
-  // Build a map for the symbols (aka the symbol table)
-  size_t sec_num = elf_reader.sections.size();
-  for (size_t i = 0; i < sec_num; i++) {
-    section *psec = elf_reader.sections[i];
-    if (psec->get_type() == SHT_SYMTAB || psec->get_type() == SHT_DYNSYM) {
-      symbol_section_accessor symbls(elf_reader, psec);
-
-      size_t sym_num = symbls.get_symbols_num();
-      for (size_t j = 0; j < sym_num; j++) {
-        std::string name;
-        Elf64_Addr value = 0;
-        Elf_Xword size = 0;
-        unsigned char bind = 0;
-        unsigned char type = 0;
-        Elf_Half section = 0;
-        unsigned char other = 0;
-        symbls.get_symbol(j, name, value, size, bind, type, section, other);
-
-        // Only add the symbol if we can actually find it later
-        // i.e. if it has a name
-        if (name.length()) {
-          symbol_t symb;
-          symb.address = value;
-          symb.size = size;
-          symb.bind = bind;
-          symb.type = type;
-          symb.section = section;
-          symb.other = other;
-          symb.name = name;
-
-          symbols.add(symb);
-        }
-      }
-    }
+  if (!ok) {
+    cerr << "Malformed elf file " << elf_file_ << endl;
+    return false;
   }
+
   return true;
 }
 
 static inline size_t align_4096(size_t length) {
-  const size_t align = (1024*4);
+  const size_t align = Memory::page_size;
   size_t res = ((length + align - 1) / align) * align;
   return res;
 }
@@ -191,8 +279,35 @@ bool Memory::allocate() {
       // For the emulator (unicorn) we need allocated memory chunks
       // to be a multiple of 4096
       m.allocated_length = align_4096((size_t)m.length);
-      m.data = new uint8_t[m.allocated_length];
-      memset(m.data, 0, m.allocated_length);
+
+      void *data;
+      if (!m.file.empty()) {
+        data = mapFile(m);
+      } else {
+        // Anonymous memory reads as zero and is only committed when touched,
+        // so large (mostly unused) segments are cheap
+        data = mmap(NULL, m.allocated_length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      }
+      if (data == MAP_FAILED) {
+        cerr << "Failed to allocate memory segment: " << m.name << endl;
+        return false;
+      }
+      m.data = (uint8_t *)data;
+
+      if (m.huge_pages) {
+#ifdef MADV_HUGEPAGE
+        if (madvise(m.data, m.allocated_length, MADV_HUGEPAGE) != 0) {
+          cerr << "Huge pages not available for memory segment: " << m.name << endl;
+        }
+#else
+        cerr << "Huge pages not supported on this platform" << endl;
+#endif
+      }
+
+      if (m.is_volatile) {
+        m.dirty.assign(m.allocated_length / page_size, 0);
+      }
     }
   } catch (const std::bad_alloc &) {
     return false;
@@ -200,12 +315,271 @@ bool Memory::allocate() {
   return true;
 }
 
+/*
+ * Map a segment shared from its backing file, a new (or empty) file is
+ * grown to the segment size and populated from the elf file
+ */
+void *Memory::mapFile(memseg_t &m) {
+  int fd = open(m.file.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    cerr << "Failed to open the backing file: " << m.file << endl;
+    return MAP_FAILED;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return MAP_FAILED;
+  }
+
+  m.file_populate = (st.st_size == 0);
+  if ((size_t)st.st_size < m.allocated_length) {
+    if (!m.file_populate) {
+      cerr << "Backing file " << m.file << " is smaller than segment "
+           << m.name << ", the rest is zero" << endl;
+    }
+    if (ftruncate(fd, m.allocated_length) != 0) {
+      cerr << "Failed to resize the backing file: " << m.file << endl;
+      close(fd);
+      return MAP_FAILED;
+    }
+  }
+
+  void *data = mmap(NULL, m.allocated_length, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);  // The mapping keeps the file open
+  return data;
+}
+
+/*
+ * Dirty page tracking
+ * Only one Memory can be tracked at a time, the SIGSEGV handler forwards
+ * faults that are not caused by a tracked page to the previous handler
+ */
+static Memory *dirty_tracking_memory = nullptr;
+static struct sigaction previous_segv_action;
+
+static void dirty_page_handler(int sig, siginfo_t *info, void *ucontext) {
+  if (dirty_tracking_memory != nullptr &&
+      dirty_tracking_memory->markDirty(info->si_addr)) {
+    // The faulting write is retried now the page is writable
+    return;
+  }
+
+  // Not ours
+  if (previous_segv_action.sa_flags & SA_SIGINFO) {
+    previous_segv_action.sa_sigaction(sig, info, ucontext);
+  } else if (previous_segv_action.sa_handler != SIG_DFL &&
+             previous_segv_action.sa_handler != SIG_IGN) {
+    previous_segv_action.sa_handler(sig);
+  } else {
+    signal(sig, SIG_DFL);
+    raise(sig);
+  }
+}
+
+bool Memory::protectPage(memseg_t &m, size_t page, bool writable) {
+  int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+  if (mprotect(&m.data[page * page_size], page_size, prot) != 0) {
+    return false;
+  }
+  m.writable[page] = writable;
+  return true;
+}
+
+bool Memory::startDirtyTracking() {
+  if (tracking_dirty_) {
+    return true;
+  }
+
+  if (dirty_tracking_memory != nullptr) {
+    cerr << "Dirty page tracking is already active for another memory" << endl;
+    return false;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = dirty_page_handler;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGSEGV, &sa, &previous_segv_action) != 0) {
+    cerr << "Failed to install the dirty page handler" << endl;
+    return false;
+  }
+  dirty_tracking_memory = this;
+  tracking_dirty_ = true;
+
+  for (auto &m : memory) {
+    size_t pages = m.allocated_length / page_size;
+    m.written.assign(pages, 0);
+    m.writable.assign(pages, 0);
+    for (size_t page = 0; page < m.dirty.size(); page++) {
+      m.dirty[page] = 0;
+    }
+    if (pages && mprotect(m.data, m.allocated_length, PROT_READ) != 0) {
+      cerr << "Failed to write protect memory segment: " << m.name << endl;
+      stopDirtyTracking();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void Memory::stopDirtyTracking() {
+  if (!tracking_dirty_) {
+    return;
+  }
+
+  for (auto &m : memory) {
+    if (m.allocated_length) {
+      mprotect(m.data, m.allocated_length, PROT_READ | PROT_WRITE);
+    }
+    m.written.clear();
+    m.writable.clear();
+  }
+
+  sigaction(SIGSEGV, &previous_segv_action, nullptr);
+  dirty_tracking_memory = nullptr;
+  tracking_dirty_ = false;
+}
+
+bool Memory::markDirty(const void *host_address) {
+  const uint8_t *addr = (const uint8_t *)host_address;
+
+  for (auto &m : memory) {
+    if (addr < m.data || addr >= m.data + m.allocated_length) {
+      continue;
+    }
+
+    size_t page = (addr - m.data) / page_size;
+    if (m.writable[page]) {
+      // Already writable, so this is a real fault
+      return false;
+    }
+
+    if (!protectPage(m, page, true)) {
+      return false;
+    }
+    m.written[page] = write_epoch_;
+    if (m.is_volatile) {
+      m.dirty[page] = 1;
+    }
+    return true;
+  }
+
+  return false;
+}
+
+uint32_t Memory::startWriteEpoch() {
+  if (!tracking_dirty_ && !startDirtyTracking()) {
+    return 0;
+  }
+
+  // Only the pages written in the current epoch are writable
+  for (auto &m : memory) {
+    for (size_t page = 0; page < m.writable.size(); page++) {
+      if (m.writable[page]) {
+        protectPage(m, page, false);
+      }
+    }
+  }
+
+  return ++write_epoch_;
+}
+
+std::vector<std::pair<size_t, size_t>> Memory::writtenSince(uint32_t epoch) {
+  std::vector<std::pair<size_t, size_t>> pages;
+  for (size_t i = 0; i < memory.size(); i++) {
+    const auto &written = memory[i].written;
+    for (size_t page = 0; page < written.size(); page++) {
+      if (written[page] >= epoch) {
+        pages.push_back(make_pair(i, page));
+      }
+    }
+  }
+  return pages;
+}
+
+std::vector<address_t> Memory::resetVolatile() {
+  std::vector<address_t> reset_pages;
+
+  for (auto &m : memory) {
+    if (!m.is_volatile) {
+      continue;
+    }
+
+    // Without tracking every page is considered dirty
+    for (size_t page = 0; page < m.dirty.size(); page++) {
+      if (tracking_dirty_ && !m.dirty[page]) {
+        continue;
+      }
+
+      // Back to the content after populate()
+      address_t page_origin = m.origin + page * page_size;
+      address_t page_end = page_origin + page_size;
+      uint8_t *page_data = &m.data[page * page_size];
+
+      memset(page_data, 0, page_size);
+      for (const auto &ml : m.memload) {
+        address_t low = max(page_origin, ml.origin);
+        address_t high = min(page_end, ml.origin + ml.length);
+        if (low < high) {
+          memcpy(&page_data[low - page_origin], &ml.data[low - ml.origin], high - low);
+        }
+      }
+
+      // Track it again, the page changed for the write epochs as well
+      if (tracking_dirty_) {
+        m.written[page] = write_epoch_;
+        protectPage(m, page, false);
+        m.dirty[page] = 0;
+      }
+
+      reset_pages.push_back(page_origin);
+    }
+  }
+
+  return reset_pages;
+}
+
+/*
+ * Map the whole pages of a load copy-on-write from the elf file, this
+ * only works if the load and its file offset are both page aligned.
+ * Returns the number of bytes mapped.
+ */
+size_t Memory::mapElfPages(memseg_t &m, const memload_t &ml) {
+  size_t start_wr = ml.origin - m.origin;
+  size_t file_offset = ml.data - elf_data_;
+  size_t length = (ml.length / page_size) * page_size;
+
+  if (elf_fd_ < 0 || length == 0 || m.huge_pages || !m.file.empty() ||
+      (start_wr % page_size) ||
+      (file_offset % page_size)) {
+    return 0;
+  }
+
+  void *data = mmap(&m.data[start_wr], length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, elf_fd_, file_offset);
+  if (data == MAP_FAILED) {
+    // Fall back to copying
+    return 0;
+  }
+  return length;
+}
+
 void Memory::populate() {
   for (auto &m : memory) {
+    // Persistent memory keeps the content of the previous run
+    if (!m.file.empty() && !m.file_populate) {
+      continue;
+    }
+
     uint8_t *data = m.data;
     for (const auto &ml : m.memload) {
       size_t start_wr = ml.origin - m.origin;
-      memcpy(&data[start_wr], ml.data, ml.length);
+      size_t mapped = mapElfPages(m, ml);
+      memcpy(&data[start_wr + mapped], &ml.data[mapped], ml.length - mapped);
     }
   }
 }
@@ -219,8 +593,29 @@ memseg_t *Memory::find(string memseg_name) {
   return nullptr;
 }
 
+void Memory::buildIndex() {
+  chunk_index_.clear();
+  for (size_t i = 0; i < memory.size(); i++) {
+    const auto &m = memory[i];
+    if (m.length == 0) {
+      continue;
+    }
+    address_t first = m.origin >> chunk_shift;
+    address_t last = (m.origin + m.length - 1) >> chunk_shift;
+    for (address_t chunk = first; chunk <= last; chunk++) {
+      chunk_index_[chunk].push_back(i);
+    }
+  }
+}
+
 memseg_t *Memory::find(address_t address) {
-  for (auto &ms : memory) {
+  auto chunk = chunk_index_.find(address >> chunk_shift);
+  if (chunk == chunk_index_.end()) {
+    return nullptr;
+  }
+
+  for (auto i : chunk->second) {
+    auto &ms = memory[i];
     if (address >= ms.origin && address < (ms.origin + ms.length)) {
       return &ms;
     }
@@ -230,6 +625,17 @@ memseg_t *Memory::find(address_t address) {
 
 char *Memory::at(address_t address) {
   auto mseg = find(address);
+  if (mseg == nullptr) {
+    return nullptr;
+  }
   char *data_start = (char *)&mseg->data[address - mseg->origin];
   return data_start;
 }
+
+char *Memory::at(address_t address, address_t size) {
+  auto mseg = find(address);
+  if (mseg == nullptr || size > (mseg->origin + mseg->length) - address) {
+    return nullptr;
+  }
+  return (char *)&mseg->data[address - mseg->origin];
+}
@@ -85,6 +85,12 @@ int main(int argc, char **argv) {
   // Actually register the hooks in the HookManager of the emulator
   plugin_manager.registerHooks(emu, emu.getHookManager());
 
+  // Install only the unicorn hooks for the events the hooks subscribed to
+  if (!emu.registerHooks()) {
+    cerr << "Error installing the emulator hooks" << endl;
+    exit(EXIT_FAILURE);
+  }
+
   cout << "Starting emulation" << endl;
   runtime.start();  // Start tracking the runtime
   emu.run();